@@ -1,25 +1,434 @@
 #include <Eigen/Dense>
 #include <Eigen/SVD>
+#include <algorithm>
 #include <random>
+#include <stdexcept>
+#include <thread>
+#include <tuple>
 #include <iostream>
+#include <limits>
+#include <mutex>
+#include <unordered_map>
 #include <math.h>
 #include <time.h>
 #include <igl/boundary_loop.h>
 #include <igl/bounding_box.h>
 #include <igl/vertex_triangle_adjacency.h>
-#include <igl/fit_plane.h>
+#include <igl/parallel_for.h>
 #include "nanoflann.hpp"
 #include "icp.h"
 
-Eigen::MatrixXd ICP::GetSubsample(Eigen::MatrixXd V_to_process, double subsample_rate){
+// Set on a thread while it runs one task of an outer parallel loop (one source or one scan pair per task)
+// Every loop of the module then stays serial on that thread instead of starting a full set of threads again
+static thread_local bool serial_passes = false;
+
+class SerialPasses{
+public:
+    explicit SerialPasses(bool serial = true) : previous(serial_passes) { serial_passes = previous || serial; }
+    ~SerialPasses() { serial_passes = previous; }
+
+private:
+    bool previous;
+};
+
+// min_parallel for igl::parallel_for, no loop is large enough to split inside an outer task
+static size_t GetMinParallel(size_t min_parallel){
+    return serial_passes ? size_t(std::numeric_limits<int>::max()) : min_parallel;
+}
+
+// Owned copy of the target scan and the KD tree built over it
+// The tree is a single-precision 3D index, distances reported to callers are recomputed in double from V
+struct ICP::Target::Index{
+
+    static const size_t max_leaf = 20;
+
+    // Points of a target grown with AddVertices, kept in nanoflann's dynamic index
+    // Inserted points go into a forest of trees of sizes 2^k, a tree is only rebuilt when the smaller ones merge into it
+    // The rows are appended in place to one row-major buffer, the trees read it directly and split it in double
+    struct DynamicTree{
+        typedef nanoflann::KDTreeSingleIndexDynamicAdaptor<nanoflann::L2_3D_Adaptor<double, DynamicTree>, DynamicTree, 3> index_t;
+
+        std::vector<double> points;
+        index_t index;
+
+        // The index must start empty, points are declared first so they exist by then
+        DynamicTree() : index(3, *this, nanoflann::KDTreeSingleIndexAdaptorParams(max_leaf)) {}
+
+        void AddPoints(const Eigen::Ref<const Eigen::MatrixXd>& V_added){
+            size_t first = kdtree_get_point_count();
+            points.resize(points.size() + 3 * V_added.rows());
+            Eigen::Map<Eigen::Matrix<double, Eigen::Dynamic, 3, Eigen::RowMajor>>(&points[3 * first], V_added.rows(), 3) = V_added;
+            index.addPoints(first, kdtree_get_point_count() - 1);
+        }
+
+        // Interface expected by the index and L2_3D_Adaptor
+        size_t kdtree_get_point_count() const { return points.size() / 3; }
+        double kdtree_get_pt(const size_t idx, int dim) const { return points[3 * idx + dim]; }
+        const double* kdtree_get_pt_ptr(const size_t idx) const { return &points[3 * idx]; }
+        template <class BBOX> bool kdtree_get_bbox(BBOX&) const { return false; }
+    };
+
+    // Copied out of the dynamic tree on first use for a grown target
+    mutable Eigen::MatrixXd V;
+    mutable std::once_flag V_copied;
+    Eigen::MatrixXi F;
+
+    // Exactly one of the two trees is set, the static one unless the target was grown
+    // The static tree holds its own float copy of V, indexes of the same scan with other faces share it
+    std::shared_ptr<const nanoflann::KDTreePointCloud3fAdaptor> kd_tree_index;
+    std::unique_ptr<DynamicTree> dynamic_tree;
+
+    // Vertex normals, estimated on first use and dropped together with the index when the geometry changes
+    mutable Eigen::MatrixXd N;
+    mutable std::once_flag N_estimated;
+
+    // Plane-like covariance of each vertex for Generalized-ICP, estimated on first use as well
+    mutable std::vector<Eigen::Matrix3d> C;
+    mutable std::once_flag C_estimated;
+
+    // The adaptor builds the tree in its constructor
+    Index(const Eigen::Ref<const Eigen::MatrixXd>& V_target, const Eigen::Ref<const Eigen::MatrixXi>& F_target) : V(V_target), F(F_target), kd_tree_index(std::make_shared<const nanoflann::KDTreePointCloud3fAdaptor>(V, int(max_leaf))) {}
+
+    // Same scan with other faces, the tree built over it is reused
+    Index(const Index& other, const Eigen::Ref<const Eigen::MatrixXi>& F_target) : V(other.V), F(F_target), kd_tree_index(other.kd_tree_index) {}
+
+    // Grown scan, every point of the tree
+    explicit Index(std::unique_ptr<DynamicTree> tree) : V(0, 3), F(0, 3), dynamic_tree(std::move(tree)) {}
+
+    size_t Size() const{
+        return dynamic_tree ? dynamic_tree->kdtree_get_point_count() : V.rows();
+    }
+
+    const Eigen::MatrixXd& GetVertices() const{
+        if (dynamic_tree){
+            std::call_once(V_copied, [this](){
+                V = Eigen::Map<const Eigen::Matrix<double, Eigen::Dynamic, 3, Eigen::RowMajor>>(dynamic_tree->points.data(), Size(), 3);
+            });
+        }
+        return V;
+    }
+
+    Eigen::RowVector3d GetVertex(size_t v) const{
+        if (dynamic_tree){
+            return Eigen::Map<const Eigen::RowVector3d>(&dynamic_tree->points[3 * v]);
+        }
+        return V.row(v);
+    }
+
+    template <typename RESULTSET>
+    void FindNeighbors(RESULTSET& result, const double* query_vertex) const{
+        if (dynamic_tree){
+            dynamic_tree->index.findNeighbors(result, query_vertex, nanoflann::SearchParams(max_leaf));
+        }else{
+            const float query_vertex_float[3] = {float(query_vertex[0]), float(query_vertex[1]), float(query_vertex[2])};
+            kd_tree_index->index->findNeighbors(result, query_vertex_float, nanoflann::SearchParams(max_leaf));
+        }
+    }
+};
+
+ICP::Target::Target(){}
+
+ICP::Target::Target(const Eigen::Ref<const Eigen::MatrixXd>& V_target){
+    SetVertices(V_target);
+}
+
+ICP::Target::Target(const Target& other) : index(other.index){
+
+    // The tree of a grown target is never shared, the copy gets one over the same points
+    if (index && index->dynamic_tree){
+        std::unique_ptr<Index::DynamicTree> tree(new Index::DynamicTree());
+        tree->AddPoints(other.GetVertices());
+        index = std::make_shared<Index>(std::move(tree));
+    }
+}
+
+ICP::Target& ICP::Target::operator=(const Target& other){
+    if (this != &other){
+        *this = Target(other);
+    }
+    return *this;
+}
+
+void ICP::Target::SetVertices(const Eigen::Ref<const Eigen::MatrixXd>& V_target){
+
+    // Same scan as before, keep the existing tree (and faces if it had any)
+    if (index && index->Size() == size_t(V_target.rows()) && index->GetVertices() == V_target){
+        return;
+    }
+
+    // Build a new index rather than modifying the old one so that copies of this target stay valid
+    index = std::make_shared<Index>(V_target, Eigen::MatrixXi(0, 3));
+}
+
+void ICP::Target::SetVertices(const Eigen::Ref<const Eigen::MatrixXd>& V_target, const Eigen::Ref<const Eigen::MatrixXi>& F_target){
+
+    if (index && index->Size() == size_t(V_target.rows()) && index->GetVertices() == V_target){
+
+        // Same mesh as before, keep everything
+        if (index->F.rows() == F_target.rows() && index->F.cols() == F_target.cols() && index->F == F_target){
+            return;
+        }
+
+        // Same scan with other (or no) faces, only the normals change
+        if (index->kd_tree_index){
+            index = std::make_shared<Index>(*index, F_target);
+            return;
+        }
+    }
+
+    index = std::make_shared<Index>(V_target, F_target);
+}
+
+void ICP::Target::AddVertices(const Eigen::Ref<const Eigen::MatrixXd>& V_added){
+
+    if (V_added.rows() == 0){
+        return;
+    }
+
+    // A grown target appends to the tree it owns, otherwise the tree starts from the current vertices
+    std::unique_ptr<Index::DynamicTree> tree;
+    if (index && index->dynamic_tree){
+        index->dynamic_tree->AddPoints(V_added);
+        tree = std::move(index->dynamic_tree);
+    }else{
+        tree.reset(new Index::DynamicTree());
+        tree->AddPoints(GetVertices());
+        tree->AddPoints(V_added);
+    }
+
+    // Normals and covariances are estimated again for the grown scan
+    index = std::make_shared<Index>(std::move(tree));
+}
+
+const Eigen::MatrixXd& ICP::Target::GetVertices() const{
+    static const Eigen::MatrixXd empty(0, 3);
+    return index ? index->GetVertices() : empty;
+}
+
+size_t ICP::Target::Size() const{
+    return index ? index->Size() : 0;
+}
+
+const Eigen::MatrixXd& ICP::Target::GetNormals() const{
+    static const Eigen::MatrixXd empty(0, 3);
+    if (!index){
+        return empty;
+    }
+
+    // Several threads may ask for the normals of a shared index at once, only one estimates them
+    std::call_once(index->N_estimated, [this](){
+        index->N = index->F.rows() > 0 ? GetVertexNormal(index->GetVertices(), index->F) : GetVertexNormal(*this);
+    });
+
+    return index->N;
+}
+
+const std::vector<Eigen::Matrix3d>& ICP::Target::GetCovariances() const{
+    static const std::vector<Eigen::Matrix3d> empty;
+    if (!index){
+        return empty;
+    }
+
+    std::call_once(index->C_estimated, [this](){
+        index->C = GetVertexCovariance(*this);
+    });
+
+    return index->C;
+}
+
+size_t ICP::Target::FindClosest(const double* query_vertex, double& dist_sqr) const{
+    size_t closest = 0;
+    dist_sqr = std::numeric_limits<double>::max();
+    FindClosest(query_vertex, 1, &closest, &dist_sqr);
+    return closest;
+}
+
+// k nearest result set of the float tree, written straight into the caller's double arrays
+// It can start from known candidate vertices instead of an empty set, so the tree search is bounded by the
+// worst candidate from the root node. A candidate reached again by the search is then not added twice
+// Distances compared during the walk stay in the tree's float type, the caller recomputes them in double
+class FloatResultSet{
+public:
+    typedef float DistanceType;
+
+    FloatResultSet(size_t capacity_, size_t* indexes_, double* dists_, size_t num_seeds = 0) : indexes(indexes_), dists(dists_), capacity(capacity_), count(0), seeded(num_seeds > 0){
+
+        // Seeds are read from the front of the output arrays, inserting seed i only writes to slots 0..i
+        for (size_t i = 0; i < num_seeds && i < capacity; i++){
+            const float dist = float(std::min(dists[i], double(std::numeric_limits<float>::max())));
+            const size_t index = indexes[i];
+            addPoint(dist, index);
+        }
+    }
+
+    size_t size() const { return count; }
+
+    bool full() const { return count == capacity; }
+
+    float worstDist() const { return count < capacity ? std::numeric_limits<float>::max() : float(dists[capacity-1]); }
+
+    bool addPoint(float dist, size_t index){
+
+        if (seeded){
+            for (size_t i = 0; i < count; i++){
+                if (indexes[i] == index) return true;
+            }
+        }
+
+        size_t i;
+        for (i = count; i > 0 && dists[i-1] > dist; i--){
+            if (i < capacity){
+                dists[i] = dists[i-1];
+                indexes[i] = indexes[i-1];
+            }
+        }
+        if (i < capacity){
+            dists[i] = dist;
+            indexes[i] = index;
+        }
+        if (count < capacity) count++;
+
+        return true;
+    }
+
+private:
+    size_t* indexes;
+    double* dists;
+    size_t capacity;
+    size_t count;
+    bool seeded;
+};
+
+size_t ICP::Target::FindClosest(const double* query_vertex, size_t num_result, size_t* indexes, double* dists_sqr, size_t num_seeds) const{
+
+    if (Size() == 0){
+        return 0;
+    }
+
+    FloatResultSet result(num_result, indexes, dists_sqr, num_seeds);
+    index->FindNeighbors(result, query_vertex);
+    size_t num_found = result.size();
+
+    // Exact squared distance to the vertices found
+    Eigen::Map<const Eigen::RowVector3d> query(query_vertex);
+    for (size_t i = 0; i < num_found; i++){
+        dists_sqr[i] = (index->GetVertex(indexes[i]) - query).squaredNorm();
+    }
+
+    return num_found;
+}
+
+void ICP::CorrespondenceCache::Reset(){
+    V_searched.resize(0, 3);
+    closest.clear();
+    second.clear();
+    margin.clear();
+    num_searched = 0;
+}
+
+// Row v of V_to_process, moved by the transform if there is one
+static inline Eigen::RowVector3d GetMovedVertex(const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, size_t v, const std::pair<Eigen::Matrix3d, Eigen::RowVector3d>* transform){
+    Eigen::RowVector3d vertex = V_to_process.row(v);
+    if (transform){
+        vertex = vertex * transform->first.transpose() + transform->second;
+    }
+    return vertex;
+}
+
+void ICP::FindClosestVertices(const Target& target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, std::vector<size_t>& indexes, std::vector<double>& dists_sqr, const std::pair<Eigen::Matrix3d, Eigen::RowVector3d>* transform){
+
+    // #Input: V1 (Indexed), V2
+    // #Output: Index of the closest V1 vertex and squared distance for each V2 vertex
+
+    // Allocate the whole output up front, each thread then fills its own slice of rows
+    // so the results end up in source order without any locking or merging step
+    indexes.resize(V_to_process.rows());
+    dists_sqr.resize(V_to_process.rows());
+
+    const size_t min_parallel = 1000;
+
+    igl::parallel_for(V_to_process.rows(), [&](const int v){
+
+        // Pick the current vertex for query
+        Eigen::RowVector3d query_vertex = GetMovedVertex(V_to_process, v, transform);
+
+        // Find the closest 1 vertex
+        indexes[v] = target.FindClosest(query_vertex.data(), dists_sqr[v]);
+
+    }, GetMinParallel(min_parallel));
+}
+
+void ICP::FindClosestVertices(const Target& target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, std::vector<size_t>& indexes, std::vector<double>& dists_sqr, CorrespondenceCache& cache, const std::pair<Eigen::Matrix3d, Eigen::RowVector3d>* transform){
+
+    // #Input: V1 (Indexed), V2, Matches of the previous pass
+    // #Output: Index of the closest V1 vertex and squared distance for each V2 vertex
+
+    const Eigen::MatrixXd& V_target = target.GetVertices();
+
+    // Nothing usable from a different source, search every vertex
+    if (cache.V_searched.rows() != V_to_process.rows()){
+        cache.V_searched.resize(V_to_process.rows(), 3);
+        cache.closest.assign(V_to_process.rows(), 0);
+        cache.second.assign(V_to_process.rows(), 0);
+        cache.margin.assign(V_to_process.rows(), -1.0);
+    }
+
+    indexes.resize(V_to_process.rows());
+    dists_sqr.resize(V_to_process.rows());
+
+    const size_t min_parallel = 1000;
+    std::vector<size_t> num_searched;
+
+    igl::parallel_for(V_to_process.rows(), [&](const size_t num_threads){
+        num_searched.assign(num_threads, 0);
+    }, [&](const int v, const size_t t){
+
+        Eigen::RowVector3d query_vertex = GetMovedVertex(V_to_process, v, transform);
+
+        // By the triangle inequality the closest vertex is now at most d1 + moved away and the second at least d2 - moved,
+        // so the match cannot have changed while moved < (d2 - d1) / 2
+        double moved = (query_vertex - cache.V_searched.row(v)).norm();
+
+        if (moved < cache.margin[v]){
+            indexes[v] = cache.closest[v];
+            dists_sqr[v] = (V_target.row(indexes[v]) - query_vertex).squaredNorm();
+            return;
+        }
+
+        // Search again, bounded by the distance to the previous two matches
+        size_t found[2] = {cache.closest[v], cache.second[v]};
+        double found_dists[2] = {(V_target.row(found[0]) - query_vertex).squaredNorm(), (V_target.row(found[1]) - query_vertex).squaredNorm()};
+        size_t num_seeds = cache.margin[v] < 0 ? 0 : 2;
+
+        size_t num_found = target.FindClosest(query_vertex.data(), 2, found, found_dists, num_seeds);
+
+        indexes[v] = found[0];
+        dists_sqr[v] = found_dists[0];
+
+        cache.V_searched.row(v) = query_vertex;
+        cache.closest[v] = found[0];
+        cache.second[v] = num_found > 1 ? found[1] : found[0];
+        cache.margin[v] = num_found > 1 ? (std::sqrt(found_dists[1]) - std::sqrt(found_dists[0])) / 2 : std::numeric_limits<double>::max();
+
+        num_searched[t]++;
+
+    }, [&](const size_t t){
+        if (t == 0) cache.num_searched = 0;
+        cache.num_searched += num_searched[t];
+    }, GetMinParallel(min_parallel));
+}
+
+Eigen::MatrixXd ICP::GetSubsample(const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, double subsample_rate, std::mt19937* generate){
 
     // #Input: V2, Int
     // #Output: V2_Subsampled
 
     // Random
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
     std::vector<int> V_index;
     for (size_t i = 0; i < V_to_process.rows(); i++) {
-        if (rand() / double(RAND_MAX) >= subsample_rate/100) {
+        double r = generate ? uniform(*generate) : rand() / double(RAND_MAX);
+        if (r >= subsample_rate/100) {
             V_index.push_back(i);
         }
     }
@@ -58,531 +467,1890 @@ Eigen::MatrixXd ICP::GetSubsample(Eigen::MatrixXd V_to_process, double subsample
 
 }
 
-Eigen::MatrixXd ICP::GetVertexNormal(Eigen::MatrixXd V_target){
+// Grid coordinates of a voxel, hashed with the usual large primes of spatial hashing
+typedef std::tuple<int, int, int> Voxel;
+
+struct VoxelHash{
+    size_t operator()(const Voxel& voxel) const{
+        return size_t(std::get<0>(voxel)) * 73856093u ^ size_t(std::get<1>(voxel)) * 19349663u ^ size_t(std::get<2>(voxel)) * 83492791u;
+    }
+};
+
+Eigen::MatrixXd ICP::GetVoxelSubsample(const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, double voxel_size){
+
+    // #Input: V2, Voxel size
+    // #Output: V2_Subsampled (one vertex per occupied voxel)
+
+    if (!(voxel_size > 0)){
+        throw std::invalid_argument("ICP: the voxel size must be positive");
+    }
+    if (V_to_process.rows() == 0){
+        return Eigen::MatrixXd(0, 3);
+    }
+
+    // Coordinates are counted from the lowest corner of the scan, so they are never negative and must fit an int
+    Eigen::RowVector3d V_min = V_to_process.colwise().minCoeff();
+    Eigen::RowVector3d V_max = V_to_process.colwise().maxCoeff();
+    if (((V_max - V_min) / voxel_size).maxCoeff() >= double(std::numeric_limits<int>::max())){
+        throw std::invalid_argument("ICP: the voxel size is too small for the extent of the scan");
+    }
+
+    // Voxel of each vertex -> output row
+    std::unordered_map<Voxel, int, VoxelHash> voxel_index;
+    std::vector<Eigen::RowVector3d> V_sum;
+    std::vector<int> V_count;
+
+    for (size_t i = 0; i < V_to_process.rows(); i++){
+
+        Eigen::RowVector3d V_i = V_to_process.row(i);
+        Voxel key(int((V_i.x() - V_min.x()) / voxel_size), int((V_i.y() - V_min.y()) / voxel_size), int((V_i.z() - V_min.z()) / voxel_size));
+
+        auto found = voxel_index.find(key);
+        if (found == voxel_index.end()){
+            voxel_index[key] = V_sum.size();
+            V_sum.push_back(V_i);
+            V_count.push_back(1);
+        }else{
+            V_sum[found->second] += V_i;
+            V_count[found->second]++;
+        }
+    }
+
+    Eigen::MatrixXd V_out(V_sum.size(), 3);
+
+    for (size_t i = 0; i < V_sum.size(); i++){
+        V_out.row(i) = V_sum[i] / V_count[i];
+    }
+
+    return V_out;
+}
+
+void ICP::TargetPyramid::SetVertices(const Eigen::Ref<const Eigen::MatrixXd>& V_target, size_t num_levels, double voxel_size){
+
+    if (num_levels < 1){
+        num_levels = 1;
+    }
+
+    // Level 0 keeps its own index caching, only the coarser levels need checking here
+    bool unchanged = levels.size() == num_levels && voxel_sizes[0] == voxel_size;
+
+    if (!levels.empty() && unchanged){
+        const Eigen::MatrixXd& V_old = levels[0].GetVertices();
+        if (V_old.rows() == V_target.rows() && V_old == V_target){
+            return;
+        }
+    }
+
+    levels.resize(num_levels);
+    voxel_sizes.resize(num_levels);
+
+    levels[0].SetVertices(V_target);
+    voxel_sizes[0] = voxel_size;
+
+    for (size_t k = 1; k < num_levels; k++){
+        voxel_sizes[k] = voxel_size * std::pow(2.0, double(k));
+        levels[k].SetVertices(GetVoxelSubsample(V_target, voxel_sizes[k]));
+    }
+}
+
+int ICP::TargetPyramid::Levels() const{
+    return levels.size();
+}
+
+const ICP::Target& ICP::TargetPyramid::GetLevel(int level) const{
+    return levels[level];
+}
+
+double ICP::TargetPyramid::GetVoxelSize(int level) const{
+    return voxel_sizes[level];
+}
+
+// Covariance of the closest 20 target vertices around vertex v, the local shape used for normals and GICP
+// Coordinates are taken relative to vertex v to keep the covariance well conditioned
+static Eigen::Matrix3d GetNeighbourhoodCovariance(const ICP::Target& target, size_t v){
+
+    const size_t num_result = 20; // 4 or 8
+
+    const Eigen::MatrixXd& V_target = target.GetVertices();
+    Eigen::RowVector3d query_vertex = V_target.row(v);
+
+    // Find the closest 20 vertices
+    size_t indexes[num_result];
+    double dists_sqr[num_result];
+    size_t num_found = target.FindClosest(query_vertex.data(), num_result, indexes, dists_sqr);
+
+    Eigen::Vector3d sum = Eigen::Vector3d::Zero();
+    Eigen::Matrix3d sum_sqr = Eigen::Matrix3d::Zero();
+    for (size_t i = 0; i < num_found; i++){
+        Eigen::Vector3d d = (V_target.row(indexes[i]) - query_vertex).transpose();
+        sum += d;
+        sum_sqr += d * d.transpose();
+    }
+    Eigen::Vector3d mean = sum / double(num_found);
+
+    return sum_sqr / double(num_found) - mean * mean.transpose();
+}
+
+Eigen::MatrixXd ICP::GetVertexNormal(const Eigen::Ref<const Eigen::MatrixXd>& V_target){
+    return GetVertexNormal(Target(V_target));
+}
+
+Eigen::MatrixXd ICP::GetVertexNormal(const Target& target){
+
+    // #Input: V1
+    // #Output: N1
+
+    const Eigen::MatrixXd& V_target = target.GetVertices();
+
+    // p <-matched q<-to process
+    Eigen::MatrixXd VN_out;
+    VN_out.resize(V_target.rows(),V_target.cols());
+    VN_out.setZero();
+
+    const size_t min_parallel = 1000;
+
+    if (V_target.rows() == 0){
+        return VN_out;
+    }
+
+    Eigen::RowVector3d center = V_target.colwise().sum()/ double(V_target.rows());
+
+    // For each vertex, every thread writes its own rows and nothing is allocated per vertex
+    igl::parallel_for(V_target.rows(), [&](const int v){
+
+        Eigen::RowVector3d query_vertex = V_target.row(v);
+        Eigen::Matrix3d covariance = GetNeighbourhoodCovariance(target, v);
+
+        // Closed-form 3x3 symmetric solver, eigenvalues come out in increasing order
+        Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver;
+        solver.computeDirect(covariance);
+        Eigen::RowVector3d N = solver.eigenvectors().col(0).transpose();
+
+        // Flip normal if pointing to the wrong direction
+        if ((center - query_vertex).dot(N) > 0) {
+            N = -N;
+        }
+
+        VN_out.row(v) = N;
+
+    }, GetMinParallel(min_parallel));
+
+    return VN_out;
+
+}
+
+Eigen::MatrixXd ICP::GetVertexNormal(const Eigen::Ref<const Eigen::MatrixXd>& V_target, const Eigen::Ref<const Eigen::MatrixXi>& F_target){
+
+    // #Input: V1, F1
+    // #Output: N1
+
+    Eigen::MatrixXd VN_out = Eigen::MatrixXd::Zero(V_target.rows(), 3);
+
+    // The cross product of two edges is twice the face area long, so summing it weights each face by its area
+    // Its direction follows the winding (v0, v1, v2), no guess based on the scan centre is needed
+    for (size_t f = 0; f < F_target.rows(); f++){
+        Eigen::RowVector3d v0 = V_target.row(F_target(f,0));
+        Eigen::RowVector3d e1 = V_target.row(F_target(f,1)) - v0;
+        Eigen::RowVector3d e2 = V_target.row(F_target(f,2)) - v0;
+        Eigen::RowVector3d N = e1.cross(e2);
+
+        for (int i = 0; i < 3; i++){
+            VN_out.row(F_target(f,i)) += N;
+        }
+    }
+
+    for (size_t v = 0; v < VN_out.rows(); v++){
+        double length = VN_out.row(v).norm();
+        if (length > 0){
+            VN_out.row(v) /= length;
+        }
+    }
+
+    return VN_out;
+}
+
+std::vector<Eigen::Matrix3d> ICP::GetVertexCovariance(const Target& target, double epsilon){
+
+    // #Input: V1
+    // #Output: C1
+
+    std::vector<Eigen::Matrix3d> C_out(target.Size());
+
+    const size_t min_parallel = 1000;
+
+    igl::parallel_for(target.Size(), [&](const int v){
+
+        // Keep the principal directions of the neighbourhood but not its extent:
+        // unit variance along the surface and epsilon across it, so every point behaves like a small disc
+        Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver;
+        solver.computeDirect(GetNeighbourhoodCovariance(target, v));
+        Eigen::Matrix3d U = solver.eigenvectors();
+
+        C_out[v] = U * Eigen::Vector3d(epsilon, 1.0, 1.0).asDiagonal() * U.transpose();
+
+    }, GetMinParallel(min_parallel));
+
+    return C_out;
+}
+
+std::pair<Eigen::MatrixXi, Eigen::MatrixXi> ICP::FindNonOverlappingFaces(const Eigen::Ref<const Eigen::MatrixXd>& V_target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const Eigen::Ref<const Eigen::MatrixXi>& F_to_process){
+    return FindNonOverlappingFaces(Target(V_target), V_to_process, F_to_process);
+}
+
+std::pair<Eigen::MatrixXi, Eigen::MatrixXi> ICP::FindNonOverlappingFaces(const Target& target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const Eigen::Ref<const Eigen::MatrixXi>& F_to_process){
+    Overlap overlap = ClassifyOverlap(target, V_to_process, F_to_process);
+    return std::pair<Eigen::MatrixXi, Eigen::MatrixXi>(std::move(overlap.F_overlap), std::move(overlap.F_non_overlap));
+}
+
+ICP::Overlap ICP::ClassifyOverlap(const Target& target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const Eigen::Ref<const Eigen::MatrixXi>& F_to_process, double threshold){
+
+    // #Input: V1 (Indexed), V2, F2
+    // #Output: Distant V2 vertices, F2 split into overlapping and non-overlapping faces
+
+    Overlap overlap;
+    overlap.distant.assign(V_to_process.rows(), 0);
+
+    const size_t min_parallel = 1000;
+
+    // Mark every vertex whose closest target vertex is too far
+    igl::parallel_for(V_to_process.rows(), [&](const int v){
+        Eigen::RowVector3d query_vertex = V_to_process.row(v);
+        double dist_sqr;
+        target.FindClosest(query_vertex.data(), dist_sqr);
+        overlap.distant[v] = dist_sqr > threshold ? 1 : 0;
+    }, GetMinParallel(min_parallel));
+
+    // A face is non-overlapping as soon as one of its vertices is distant
+    std::vector<char> face_distant(F_to_process.rows());
+    igl::parallel_for(F_to_process.rows(), [&](const int f){
+        face_distant[f] = overlap.distant[F_to_process(f, 0)] | overlap.distant[F_to_process(f, 1)] | overlap.distant[F_to_process(f, 2)];
+    }, GetMinParallel(min_parallel));
+
+    size_t num_distant_vertices = std::count(overlap.distant.begin(), overlap.distant.end(), 1);
+    size_t num_non_overlap = std::count(face_distant.begin(), face_distant.end(), 1);
+    overlap.ratio = V_to_process.rows() > 0 ? 1.0 - double(num_distant_vertices) / V_to_process.rows() : 0.0;
+
+    // Both parts are allocated once and filled in face order
+    overlap.F_overlap.resize(F_to_process.rows() - num_non_overlap, 3);
+    overlap.F_non_overlap.resize(num_non_overlap, 3);
+
+    size_t num_overlap_filled = 0;
+    size_t num_non_overlap_filled = 0;
+    for (size_t f = 0; f < F_to_process.rows(); f++){
+        if (face_distant[f]){
+            overlap.F_non_overlap.row(num_non_overlap_filled++) = F_to_process.row(f);
+        }else{
+            overlap.F_overlap.row(num_overlap_filled++) = F_to_process.row(f);
+        }
+    }
+
+    return overlap;
+}
+
+Eigen::MatrixXd ICP::Rotate(const Eigen::Ref<const Eigen::MatrixXd>& V_in, double x, double y, double z){
+    
+    // Initialise
+    Eigen::MatrixXd V_out;
+    V_out.resize(V_in.rows(), V_in.cols());
+    V_out.setZero();
+    
+    // Construct rotation matrix
+    Eigen::Matrix3d R;
+    R = Eigen::AngleAxisd(x * M_PI/180, Eigen::Vector3d::UnitX()) * Eigen::AngleAxisd(y * M_PI/180, Eigen::Vector3d::UnitY()) * Eigen::AngleAxisd(z * M_PI/180, Eigen::Vector3d::UnitZ());
+    
+    // Rotate the vertex
+    V_out = V_in * R;
+    
+    return V_out;
+    
+}
+
+Eigen::MatrixXd ICP::AddNoise(const Eigen::Ref<const Eigen::MatrixXd>& V_in, double sd){
+    
+    // Initialise output matrix
+    Eigen::MatrixXd V_out;
+    V_out.resize(V_in.rows(), V_in.cols());
+    V_out.setZero();
+
+    Eigen::MatrixXd V_bounding;
+    Eigen::MatrixXi F_bounding;
+
+    igl::bounding_box(V_in, V_bounding, F_bounding);
+    double noise_scale_x = abs(V_bounding.row(0).x()-V_bounding.row(4).x());
+    double noise_scale_y = abs(V_bounding.row(0).y()-V_bounding.row(2).y());
+    double noise_scale_z = abs(V_bounding.row(0).z()-V_bounding.row(1).z());
+
+    // Random number generation
+    std::default_random_engine rnd;
+    std::normal_distribution<double> gaussian(0.0, sd);
+    
+    // Add noise to the vertex
+    for (int i=0; i<V_out.rows(); i++){
+        double x =gaussian(rnd)/(10000*noise_scale_x);
+        double y =gaussian(rnd)/(10000*noise_scale_y);
+        double z =gaussian(rnd)/(10000*noise_scale_z);
+        Eigen::RowVector3d noise(x,y,z);
+        V_out.row(i) = V_in.row(i) + noise;
+    }
+    
+    return V_out;
+    
+}
+
+Eigen::MatrixXd ICP::FindBestStartRotation(const Eigen::Ref<const Eigen::MatrixXd>& V_target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process){
+    return FindBestStartRotation(Target(V_target), V_to_process);
+}
+
+Eigen::MatrixXd ICP::FindBestStartRotation(const Target& target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process){
+    return ApplyRigidTransform(V_to_process, FindStartPose(target, V_to_process));
+}
+
+// Centroid and principal axes (columns, by increasing variance) of a scan
+static std::pair<Eigen::RowVector3d, Eigen::Matrix3d> GetPrincipalAxes(const Eigen::Ref<const Eigen::MatrixXd>& V){
+    Eigen::RowVector3d centroid = V.colwise().mean();
+    Eigen::Matrix3d covariance = (V.rowwise() - centroid).transpose() * (V.rowwise() - centroid);
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eigen_solver(covariance);
+    return std::pair<Eigen::RowVector3d, Eigen::Matrix3d>(centroid, eigen_solver.eigenvectors());
+}
+
+std::pair<Eigen::Matrix3d, Eigen::RowVector3d> ICP::FindStartPose(const Target& target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, size_t sample_size){
+
+    // #Input: V1 (Indexed), V2
+    // #Output: R, T (V2 -> V1)
+
+    typedef std::pair<Eigen::Matrix3d, Eigen::RowVector3d> Pose;
+
+    // Nothing to score, keep the scan where it is
+    if (V_to_process.rows() == 0 || target.Size() == 0){
+        return Pose(Eigen::Matrix3d::Identity(), Eigen::RowVector3d::Zero());
+    }
+
+    std::vector<Pose> candidates;
+
+    // Apply a 0(360), 120 , 240 rotation for each axis, about the origin as Rotate does (V * R, i.e. R^T on column vertices)
+    for (int x = 0; x < 3; x++){
+        for (int y = 0; y < 3; y++){
+            for (int z = 0; z < 3; z ++){
+                Eigen::Matrix3d R;
+                R = Eigen::AngleAxisd(x * 120 * M_PI/180, Eigen::Vector3d::UnitX()) * Eigen::AngleAxisd(y * 120 * M_PI/180, Eigen::Vector3d::UnitY()) * Eigen::AngleAxisd(z * 120 * M_PI/180, Eigen::Vector3d::UnitZ());
+                candidates.push_back(Pose(R.transpose(), Eigen::RowVector3d::Zero()));
+            }
+        }
+    }
+
+    // Map the principal axes of V2 onto those of V1, an axis may be flipped so keep the 4 sign choices without a reflection
+    std::pair<Eigen::RowVector3d, Eigen::Matrix3d> axes_target = GetPrincipalAxes(target.GetVertices());
+    std::pair<Eigen::RowVector3d, Eigen::Matrix3d> axes_to_process = GetPrincipalAxes(V_to_process);
+    double handedness = axes_target.second.determinant() * axes_to_process.second.determinant();
+
+    for (int flip = 0; flip < 4; flip++){
+        Eigen::Vector3d signs(flip & 1 ? -1.0 : 1.0, flip & 2 ? -1.0 : 1.0, 1.0);
+        signs.z() = signs.x() * signs.y() * handedness;
+
+        Eigen::Matrix3d R = axes_target.second * signs.asDiagonal() * axes_to_process.second.transpose();
+        Eigen::RowVector3d T = axes_target.first - (R * axes_to_process.first.transpose()).transpose();
+        candidates.push_back(Pose(R, T));
+    }
+
+    // Nested random samples, each round reads the first sample_size rows of the same shuffled order
+    std::vector<size_t> order(V_to_process.rows());
+    for (size_t v = 0; v < order.size(); v++){
+        order[v] = v;
+    }
+    std::mt19937 generate(0);
+    std::shuffle(order.begin(), order.end(), generate);
+
+    std::vector<size_t> alive(candidates.size());
+    for (size_t c = 0; c < alive.size(); c++){
+        alive[c] = c;
+    }
+    std::vector<double> scores(candidates.size(), std::numeric_limits<double>::max());
+
+    sample_size = std::max<size_t>(sample_size, 1);
+
+    while (true){
+        size_t num_sample = std::min(sample_size, order.size());
+
+        // One candidate per task, the closest vertex queries of a small sample are too few to split further
+        igl::parallel_for(alive.size(), [&](const int i){
+            const Pose& pose = candidates[alive[i]];
+
+            std::vector<double> dists_sqr(num_sample);
+            for (size_t s = 0; s < num_sample; s++){
+                Eigen::RowVector3d query_vertex = V_to_process.row(order[s]) * pose.first.transpose() + pose.second;
+                target.FindClosest(query_vertex.data(), dists_sqr[s]);
+            }
+
+            // The scans only partly overlap, so score the closest half of the pairs
+            size_t num_kept = std::max<size_t>(num_sample / 2, 1);
+            std::nth_element(dists_sqr.begin(), dists_sqr.begin() + (num_kept - 1), dists_sqr.end());
+            double sum = 0;
+            for (size_t s = 0; s < num_kept; s++){
+                sum += dists_sqr[s];
+            }
+            scores[alive[i]] = sum / num_kept;
+        }, GetMinParallel(1));
+
+        std::sort(alive.begin(), alive.end(), [&](size_t a, size_t b){ return scores[a] < scores[b]; });
+
+        // Race until one pose is left or the whole scan has been scored
+        if (alive.size() == 1 || num_sample == order.size()){
+            break;
+        }
+        alive.resize((alive.size() + 1) / 2);
+        sample_size *= 2;
+    }
+
+    return candidates[alive.front()];
+}
+
+// Simplified point feature histogram of keypoint k: the Darboux frame angles to each neighbour, 11 bins per angle
+// Every angle histogram sums to 100 whatever the number of neighbours
+static Eigen::Matrix<float, 1, 33> GetPointFeatureHistogram(const Eigen::MatrixXd& V, const Eigen::MatrixXd& N, size_t k, const std::vector<size_t>& neighbours){
+
+    Eigen::Matrix<float, 1, 33> histogram = Eigen::Matrix<float, 1, 33>::Zero();
+
+    size_t num_pairs = 0;
+    for (size_t i = 0; i < neighbours.size(); i++){
+        if (neighbours[i] != k) num_pairs++;
+    }
+    if (num_pairs == 0){
+        return histogram;
+    }
+    const float increment = 100.0f / num_pairs;
+
+    for (size_t i = 0; i < neighbours.size(); i++){
+        size_t j = neighbours[i];
+        if (j == k) continue;
+
+        Eigen::Vector3d p_s = V.row(k), n_s = N.row(k);
+        Eigen::Vector3d p_t = V.row(j), n_t = N.row(j);
+        Eigen::Vector3d d = p_t - p_s;
+        double length = d.norm();
+        if (length == 0) continue;
+        d /= length;
+
+        // The frame sits on the point whose normal is closer to the line joining them
+        if (std::abs(n_s.dot(d)) < std::abs(n_t.dot(d))){
+            std::swap(p_s, p_t);
+            std::swap(n_s, n_t);
+            d = -d;
+        }
+
+        Eigen::Vector3d u = n_s;
+        Eigen::Vector3d v = u.cross(d);
+        if (v.norm() < 1e-12) continue;
+        v.normalize();
+        Eigen::Vector3d w = u.cross(v);
+
+        double alpha = v.dot(n_t);
+        double phi = u.dot(d);
+        double theta = std::atan2(w.dot(n_t), u.dot(n_t));
+
+        int bin_alpha = std::min(10, std::max(0, int(std::floor(11 * (alpha + 1) / 2))));
+        int bin_phi = std::min(10, std::max(0, int(std::floor(11 * (phi + 1) / 2))));
+        int bin_theta = std::min(10, std::max(0, int(std::floor(11 * (theta + M_PI) / (2 * M_PI)))));
+
+        histogram[bin_alpha] += increment;
+        histogram[11 + bin_phi] += increment;
+        histogram[22 + bin_theta] += increment;
+    }
+
+    return histogram;
+}
+
+// Keypoints within the radius of keypoint k, the k-nearest search is widened until the radius is covered
+static void GetNeighbours(const ICP::Target& keypoints, size_t k, double radius, std::vector<size_t>& neighbours, std::vector<double>& dists_sqr){
+
+    const Eigen::MatrixXd& V = keypoints.GetVertices();
+    Eigen::RowVector3d query_vertex = V.row(k);
+    double radius_sqr = radius * radius;
+
+    for (size_t num_result = 32; ; num_result *= 2){
+        neighbours.resize(num_result);
+        dists_sqr.resize(num_result);
+        size_t num_found = keypoints.FindClosest(query_vertex.data(), num_result, neighbours.data(), dists_sqr.data());
+        neighbours.resize(num_found);
+        dists_sqr.resize(num_found);
+
+        if (num_found < num_result || dists_sqr.back() > radius_sqr){
+            break;
+        }
+    }
+
+    size_t num_kept = std::lower_bound(dists_sqr.begin(), dists_sqr.end(), radius_sqr, [](double a, double b){ return a <= b; }) - dists_sqr.begin();
+    neighbours.resize(num_kept);
+    dists_sqr.resize(num_kept);
+}
+
+ICP::FeatureCloud ICP::GetFeatures(const Eigen::Ref<const Eigen::MatrixXd>& V, double voxel_size){
+
+    // #Input: V
+    // #Output: Keypoints (Indexed), FPFH of each keypoint
+
+    FeatureCloud features;
+    features.keypoints.SetVertices(GetVoxelSubsample(V, voxel_size));
+
+    const Eigen::MatrixXd& V_keypoints = features.keypoints.GetVertices();
+    const Eigen::MatrixXd& N_keypoints = features.keypoints.GetNormals();
+    const size_t num_keypoints = V_keypoints.rows();
+    const double radius = 5 * voxel_size;
+    const size_t min_parallel = 100;
+
+    // Neighbourhoods are kept, the second pass weights the histograms of the same neighbours
+    std::vector<std::vector<size_t>> neighbours(num_keypoints);
+    std::vector<std::vector<double>> dists_sqr(num_keypoints);
+    Eigen::Matrix<float, Eigen::Dynamic, 33, Eigen::RowMajor> histograms(num_keypoints, 33);
+
+    igl::parallel_for(num_keypoints, [&](const int k){
+        GetNeighbours(features.keypoints, k, radius, neighbours[k], dists_sqr[k]);
+        histograms.row(k) = GetPointFeatureHistogram(V_keypoints, N_keypoints, k, neighbours[k]);
+    }, GetMinParallel(min_parallel));
+
+    // FPFH = own histogram + the neighbours' histograms weighted by 1 / distance, each angle rescaled to 100
+    features.descriptors.resize(num_keypoints, 33);
+    igl::parallel_for(num_keypoints, [&](const int k){
+        Eigen::Matrix<float, 1, 33> neighbourhood = Eigen::Matrix<float, 1, 33>::Zero();
+        for (size_t i = 0; i < neighbours[k].size(); i++){
+            if (neighbours[k][i] == size_t(k) || dists_sqr[k][i] <= 0) continue;
+            neighbourhood += histograms.row(neighbours[k][i]) / float(std::sqrt(dists_sqr[k][i]));
+        }
+        for (int a = 0; a < 3; a++){
+            float sum = neighbourhood.segment<11>(11 * a).sum();
+            if (sum > 0){
+                neighbourhood.segment<11>(11 * a) *= 100.0f / sum;
+            }
+        }
+        features.descriptors.row(k) = histograms.row(k) + neighbourhood;
+    }, GetMinParallel(min_parallel));
+
+    return features;
+}
+
+std::pair<Eigen::Matrix3d, Eigen::RowVector3d> ICP::FindFeaturePose(const FeatureCloud& target, const FeatureCloud& source, double voxel_size, int max_iteration, size_t* num_inliers){
+
+    // #Input: V1 features, V2 features
+    // #Output: R, T (V2 -> V1)
+
+    typedef std::pair<Eigen::Matrix3d, Eigen::RowVector3d> Pose;
+    typedef Eigen::Matrix<float, Eigen::Dynamic, 33, Eigen::RowMajor> DescriptorMatrix;
+
+    Pose best_pose(Eigen::Matrix3d::Identity(), Eigen::RowVector3d::Zero());
+    if (num_inliers){
+        *num_inliers = 0;
+    }
+
+    const Eigen::MatrixXd& V_target = target.keypoints.GetVertices();
+    const Eigen::MatrixXd& V_source = source.keypoints.GetVertices();
+    if (V_target.rows() < 3 || V_source.rows() < 3){
+        return best_pose;
+    }
+
+    // Closest target descriptor for every source keypoint
+    nanoflann::KDTreeEigenMatrixAdaptor<DescriptorMatrix, nanoflann::metric_L2_Simple> descriptor_index(target.descriptors, 10);
+    std::vector<size_t> matches(V_source.rows());
+    igl::parallel_for(V_source.rows(), [&](const int k){
+        Eigen::Index index = 0;
+        float dist_sqr;
+        descriptor_index.query(source.descriptors.row(k).data(), 1, &index, &dist_sqr);
+        matches[k] = index;
+    }, GetMinParallel(1000));
+
+    const size_t num_pairs = matches.size();
+    const double inlier_dist_sqr = (1.5 * voxel_size) * (1.5 * voxel_size);
+    const double edge_similarity = 0.9;
+
+    // Pairs within the inlier distance once the source keypoints are moved by the pose
+    auto count_inliers = [&](const Pose& pose){
+        size_t count = 0;
+        for (size_t k = 0; k < num_pairs; k++){
+            Eigen::RowVector3d moved = V_source.row(k) * pose.first.transpose() + pose.second;
+            if ((V_target.row(matches[k]) - moved).squaredNorm() < inlier_dist_sqr) count++;
+        }
+        return count;
+    };
+
+    // Hypotheses are drawn in rounds, each thread keeps its best one of a round and the best of all threads wins
+    // After each round the number of hypotheses needed to draw one all-inlier sample with 99.9% confidence is
+    // estimated from the best inlier ratio so far, the search stops once that many were drawn
+    const size_t round_size = 1000;
+    const double confidence = 0.999;
+    std::vector<Pose> thread_pose;
+    std::vector<size_t> thread_inliers;
+    size_t best_inliers = 0;
+    size_t num_needed = size_t(std::max(max_iteration, 0));
+
+    for (size_t first = 0; first < num_needed; first += round_size){
+        size_t num_drawn = std::min(round_size, num_needed - first);
+
+        igl::parallel_for(num_drawn, [&](const size_t num_threads){
+            thread_pose.assign(num_threads, best_pose);
+            thread_inliers.assign(num_threads, 0);
+        }, [&](const int r, const size_t t){
+
+            // Seeded through a seed sequence from the hypothesis number, so the search does not depend on the thread split
+            // and the draws of consecutive hypotheses are not correlated
+            std::seed_seq seed{uint32_t(first + r)};
+            uint32_t state;
+            seed.generate(&state, &state + 1);
+            std::minstd_rand generate(state);
+            std::uniform_int_distribution<size_t> distribution(0, num_pairs - 1);
+            size_t sample[3] = {distribution(generate), distribution(generate), distribution(generate)};
+            if (sample[0] == sample[1] || sample[1] == sample[2] || sample[0] == sample[2]){
+                return;
+            }
+
+            // A rigid transform keeps every edge of the triangle
+            for (int a = 0; a < 3; a++){
+                int b = (a + 1) % 3;
+                double edge_source = (V_source.row(sample[a]) - V_source.row(sample[b])).norm();
+                double edge_target = (V_target.row(matches[sample[a]]) - V_target.row(matches[sample[b]])).norm();
+                if (edge_source < edge_similarity * edge_target || edge_target < edge_similarity * edge_source){
+                    return;
+                }
+            }
+
+            PointToPointSums sums;
+            sums.origin = V_source.row(sample[0]);
+            for (int a = 0; a < 3; a++){
+                sums.Add(V_target.row(matches[sample[a]]), V_source.row(sample[a]));
+            }
+            Pose pose = EstimateRigidTransform(sums).second;
+
+            size_t inliers = count_inliers(pose);
+            if (inliers > thread_inliers[t]){
+                thread_inliers[t] = inliers;
+                thread_pose[t] = pose;
+            }
+
+        }, [&](const size_t t){
+            if (thread_inliers[t] > best_inliers){
+                best_inliers = thread_inliers[t];
+                best_pose = thread_pose[t];
+            }
+        }, GetMinParallel(1000));
+
+        double inlier_ratio = double(best_inliers) / num_pairs;
+        double all_inliers = inlier_ratio * inlier_ratio * inlier_ratio;
+        if (all_inliers >= 1.0){
+            break;
+        }
+        if (all_inliers > 0.0){
+            double num_required = std::ceil(std::log(1.0 - confidence) / std::log(1.0 - all_inliers));
+            num_needed = std::min(num_needed, size_t(std::max(num_required, double(first + num_drawn))));
+        }
+    }
+
+    if (best_inliers < 3){
+        return best_pose;
+    }
+
+    // Refit to every inlier of the best hypothesis
+    PointToPointSums sums;
+    sums.origin = V_source.row(0);
+    for (size_t k = 0; k < num_pairs; k++){
+        Eigen::RowVector3d moved = V_source.row(k) * best_pose.first.transpose() + best_pose.second;
+        if ((V_target.row(matches[k]) - moved).squaredNorm() < inlier_dist_sqr){
+            sums.Add(V_target.row(matches[k]), V_source.row(k));
+        }
+    }
+    Pose refined = EstimateRigidTransform(sums).second;
+    size_t refined_inliers = count_inliers(refined);
+    if (refined_inliers >= best_inliers){
+        best_pose = refined;
+        best_inliers = refined_inliers;
+    }
+
+    if (num_inliers){
+        *num_inliers = best_inliers;
+    }
+
+    return best_pose;
+}
+
+std::pair<Eigen::MatrixXd, Eigen::MatrixXd> ICP::FindCorrespondences(const Eigen::Ref<const Eigen::MatrixXd>& V_target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process){
+    return FindCorrespondences(Target(V_target), V_to_process);
+}
+
+// Median by O(n) selection, values is partially reordered in place
+static double GetMedian(std::vector<double>& values){
+
+    if (values.empty()){
+        return 0.0;
+    }
+
+    size_t middle = values.size() / 2;
+    std::nth_element(values.begin(), values.begin() + middle, values.end());
+    double median = values[middle];
+
+    // Even size, average with the largest value of the lower half (already on the left of middle)
+    if (values.size() % 2 == 0){
+        median = (median + *std::max_element(values.begin(), values.begin() + middle)) / 2;
+    }
+
+    return median;
+}
+
+ICP::RejectionPolicy ICP::RejectionPolicy::Median(double k){
+    RejectionPolicy policy;
+    policy.type = REJECT_MEDIAN;
+    policy.k = k;
+    return policy;
+}
+
+ICP::RejectionPolicy ICP::RejectionPolicy::MAD(double k){
+    RejectionPolicy policy;
+    policy.type = REJECT_MAD;
+    policy.k = k;
+    return policy;
+}
+
+ICP::RejectionPolicy ICP::RejectionPolicy::Percentile(double percentile){
+    RejectionPolicy policy;
+    policy.type = REJECT_PERCENTILE;
+    policy.percentile = percentile;
+    return policy;
+}
+
+ICP::RejectionPolicy ICP::RejectionPolicy::NormalCompatible(double max_normal_angle){
+    RejectionPolicy policy;
+    policy.type = REJECT_NONE;
+    policy.max_normal_angle = max_normal_angle;
+    return policy;
+}
+
+ICP::RejectionPolicy ICP::RejectionPolicy::Robust(const RobustKernel& kernel){
+    RejectionPolicy policy;
+    policy.type = REJECT_NONE;
+    policy.kernel = kernel;
+    return policy;
+}
+
+ICP::RobustKernel ICP::RobustKernel::Huber(double k){
+    RobustKernel kernel;
+    kernel.type = KERNEL_HUBER;
+    kernel.k = k;
+    return kernel;
+}
+
+ICP::RobustKernel ICP::RobustKernel::Tukey(double k){
+    RobustKernel kernel;
+    kernel.type = KERNEL_TUKEY;
+    kernel.k = k;
+    return kernel;
+}
+
+ICP::RobustKernel ICP::RobustKernel::Cauchy(double k){
+    RobustKernel kernel;
+    kernel.type = KERNEL_CAUCHY;
+    kernel.k = k;
+    return kernel;
+}
+
+double ICP::RobustKernel::GetWeight(double residual, double sigma) const{
+
+    double c = k * sigma;
+
+    // Every residual is zero, nothing to tell apart
+    if (type == KERNEL_NONE || c <= 0){
+        return 1.0;
+    }
+
+    double u = residual / c;
+
+    switch (type){
+        case KERNEL_HUBER:
+            return u <= 1.0 ? 1.0 : 1.0 / u;
+        case KERNEL_TUKEY:
+            return u < 1.0 ? (1.0 - u * u) * (1.0 - u * u) : 0.0;
+        case KERNEL_CAUCHY:
+            return 1.0 / (1.0 + u * u);
+        default:
+            return 1.0;
+    }
+}
+
+// Robust scale of the pair distances below the threshold, 1.4826 * median distance
+// The distances are selected in scratch, which keeps its capacity for the next call
+static double GetRobustScale(const std::vector<double>& dists_sqr, double threshold, std::vector<double>& scratch){
+    scratch.clear();
+    for (size_t i = 0; i < dists_sqr.size(); i++){
+        if (dists_sqr[i] <= threshold){
+            scratch.push_back(std::sqrt(dists_sqr[i]));
+        }
+    }
+    return 1.4826 * GetMedian(scratch);
+}
+
+// Squared distance above which a pair is rejected, every statistic below is found by selection rather than sorting
+// dists_sqr keeps its order (it is indexed by source vertex), the selections run in scratch instead
+static double GetRejectionThreshold(const std::vector<double>& dists_sqr, const ICP::RejectionPolicy& policy, std::vector<double>& scratch){
+
+    double threshold = std::numeric_limits<double>::max();
+
+    switch (policy.type){
+
+        // The pairs rejection can be done using k * median distance
+        // Reference slide: http://resources.mpi-inf.mpg.de/deformableShapeMatching/EG2011_Tutorial/slides/2.1%20Rigid%20ICP.pdf Page 8
+        case ICP::RejectionPolicy::REJECT_MEDIAN:{
+            scratch.assign(dists_sqr.begin(), dists_sqr.end());
+            threshold = policy.k * GetMedian(scratch);
+            break;
+        }
+
+        // Median + k * sigma, with sigma estimated from the median absolute deviation of the (unsquared) distances
+        case ICP::RejectionPolicy::REJECT_MAD:{
+            scratch.resize(dists_sqr.size());
+            for (size_t i = 0; i < dists_sqr.size(); i++){
+                scratch[i] = std::sqrt(dists_sqr[i]);
+            }
+            double median = GetMedian(scratch);
+
+            // The order does not matter to the median, so the deviations overwrite the distances in place
+            for (size_t i = 0; i < scratch.size(); i++){
+                scratch[i] = std::abs(scratch[i] - median);
+            }
+            double distance_max = median + policy.k * 1.4826 * GetMedian(scratch);
+            threshold = distance_max * distance_max;
+            break;
+        }
+
+        // Keep the given fraction of closest pairs
+        case ICP::RejectionPolicy::REJECT_PERCENTILE:{
+            if (!dists_sqr.empty() && policy.percentile < 1.0){
+                scratch.assign(dists_sqr.begin(), dists_sqr.end());
+                size_t nth = size_t(std::max(0.0, policy.percentile) * (scratch.size() - 1));
+                std::nth_element(scratch.begin(), scratch.begin() + nth, scratch.end());
+                threshold = scratch[nth];
+            }
+            break;
+        }
+
+        case ICP::RejectionPolicy::REJECT_NONE:
+            break;
+    }
+
+    return threshold;
+}
+
+// A normal test without normals would keep every pair without telling anyone
+static void CheckNormalTest(const ICP::RejectionPolicy& policy, bool has_normals){
+    if (policy.max_normal_angle < 180.0 && !has_normals){
+        throw std::invalid_argument("ICP: the rejection policy tests normals but no source or target normals were given");
+    }
+}
+
+ICP::Correspondences ICP::RejectCorrespondences(const std::vector<size_t>& indexes, const std::vector<double>& dists_sqr, const RejectionPolicy& policy, const Eigen::MatrixXd* N_to_process, const Eigen::MatrixXd* N_target){
+
+    // #Input: Closest V1 vertex and squared distance for each V2 vertex
+    // #Output: Index pairs kept (V2 -> V1) and their weights
+
+    CheckNormalTest(policy, N_to_process && N_target);
+
+    Correspondences correspondences;
+
+    // One scratch buffer serves every selection of the pass
+    std::vector<double> scratch;
+    scratch.reserve(dists_sqr.size());
+    double threshold = GetRejectionThreshold(dists_sqr, policy, scratch);
+
+    // The kernel scale is re-estimated on every pass, so successive ICP iterations reweight like IRLS
+    bool use_kernel = policy.kernel.type != RobustKernel::KERNEL_NONE;
+    double sigma = use_kernel ? GetRobustScale(dists_sqr, threshold, scratch) : 0.0;
+
+    bool check_normal = policy.max_normal_angle < 180.0;
+    double min_cosine = std::cos(policy.max_normal_angle * M_PI / 180);
+
+    correspondences.source.reserve(indexes.size());
+    correspondences.target.reserve(indexes.size());
+    correspondences.weights.reserve(indexes.size());
+
+    for (size_t i = 0; i < indexes.size(); i++){
+
+        if (dists_sqr[i] > threshold){
+            // Distant vertex, ignore.
+            continue;
+        }
+
+        if (check_normal && N_to_process->row(i).dot(N_target->row(indexes[i])) < min_cosine){
+            // Incompatible orientation, ignore.
+            continue;
+        }
+
+        double weight = use_kernel ? policy.kernel.GetWeight(std::sqrt(dists_sqr[i]), sigma) : 1.0;
+
+        if (weight <= 0){
+            // Fully down-weighted by the kernel, ignore.
+            continue;
+        }
+
+        correspondences.source.push_back(i);
+        correspondences.target.push_back(indexes[i]);
+        correspondences.weights.push_back(weight);
+    }
+
+    return correspondences;
+}
+
+ICP::Correspondences ICP::FindCorrespondences(const Target& target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const RejectionPolicy& policy, CorrespondenceCache* cache, const Eigen::MatrixXd* N_to_process){
+
+    // #Input: V1, V2 (Without Rejection)
+    // #Output: Index pairs (With Rejection)
+
+    std::vector<size_t> indexes;
+    std::vector<double> distances;
+
+    // Find the closest vertex for each vertex (in parallel, warm-started from the previous pass if possible)
+    if (cache){
+        FindClosestVertices(target, V_to_process, indexes, distances, *cache);
+    }else{
+        FindClosestVertices(target, V_to_process, indexes, distances);
+    }
+
+    // The target normals are only estimated if the source has normals to test against them
+    return RejectCorrespondences(indexes, distances, policy, N_to_process, N_to_process ? &target.GetNormals() : nullptr);
+}
+
+void ICP::PointToPointSums::Add(const Eigen::RowVector3d& p, const Eigen::RowVector3d& q, double w){
+    Eigen::RowVector3d p_i = p - origin;
+    Eigen::RowVector3d q_i = q - origin;
+
+    count++;
+    weight += w;
+    sum_p += w * p_i;
+    sum_q += w * q_i;
+    sum_qp += w * q_i.transpose() * p_i;
+    sum_pp += w * p_i.squaredNorm();
+    sum_qq += w * q_i.squaredNorm();
+}
+
+void ICP::PointToPointSums::Add(const PointToPointSums& other){
+    count += other.count;
+    weight += other.weight;
+    sum_p += other.sum_p;
+    sum_q += other.sum_q;
+    sum_qp += other.sum_qp;
+    sum_pp += other.sum_pp;
+    sum_qq += other.sum_qq;
+}
+
+double ICP::PointToPointSums::GetError() const{
+
+    // Sigma w ||p - q||^2 = Sigma w ||p||^2 + Sigma w ||q||^2 - 2 trace(Sigma w q p^T)
+    return weight > 0 ? std::max(0.0, sum_pp + sum_qq - 2 * sum_qp.trace()) / weight : 0.0;
+}
+
+Eigen::Matrix3d ICP::PointToPointSums::GetCrossCovariance() const{
+
+    // Sigma w (q - q_bar)(p - p_bar)^T = Sigma w q p^T - (Sigma w q)(Sigma w p)^T / Sigma w
+    return sum_qp - sum_q.transpose() * sum_p / weight;
+}
+
+ICP::PointToPointSums ICP::AccumulateCorrespondences(const Target& target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const RejectionPolicy& policy, CorrespondenceCache* cache, const std::pair<Eigen::Matrix3d, Eigen::RowVector3d>* transform){
+
+    // #Input: V1, V2 (Without Rejection)
+    // #Output: Sums over the kept pairs (With Rejection)
+
+    CheckNormalTest(policy, false);
+
+    std::vector<size_t> indexes;
+    std::vector<double> distances;
+
+    if (cache){
+        FindClosestVertices(target, V_to_process, indexes, distances, *cache, transform);
+    }else{
+        FindClosestVertices(target, V_to_process, indexes, distances, transform);
+    }
+
+    std::vector<double> scratch;
+    scratch.reserve(distances.size());
+    double threshold = GetRejectionThreshold(distances, policy, scratch);
+
+    bool use_kernel = policy.kernel.type != RobustKernel::KERNEL_NONE;
+    double sigma = use_kernel ? GetRobustScale(distances, threshold, scratch) : 0.0;
+
+    const Eigen::MatrixXd& V_target = target.GetVertices();
+
+    PointToPointSums sums;
+    if (V_to_process.rows() > 0){
+        sums.origin = GetMovedVertex(V_to_process, 0, transform);
+    }
+
+    // Each thread sums its own rows, the partial sums are merged at the end
+    const size_t min_parallel = 1000;
+    std::vector<PointToPointSums> partial_sums;
+
+    igl::parallel_for(V_to_process.rows(), [&](const size_t num_threads){
+        partial_sums.assign(num_threads, sums);
+    }, [&](const int v, const size_t t){
+
+        if (distances[v] > threshold){
+            // Distant vertex, ignore.
+            return;
+        }
+
+        double weight = use_kernel ? policy.kernel.GetWeight(std::sqrt(distances[v]), sigma) : 1.0;
+
+        if (weight <= 0){
+            return;
+        }
+
+        partial_sums[t].Add(V_target.row(indexes[v]), GetMovedVertex(V_to_process, v, transform), weight);
+
+    }, [&](const size_t t){
+        sums.Add(partial_sums[t]);
+    }, GetMinParallel(min_parallel));
+
+    return sums;
+}
+
+std::pair<Eigen::MatrixXd, Eigen::MatrixXd> ICP::FindCorrespondences(const Target& target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, CorrespondenceCache* cache){
+
+    // #Input: V1, V2 (Without Rejection)
+    // #Output: V1_Matched, V2_Matched (With Rejection)
+
+    const double k = 2.0;
+    const Eigen::MatrixXd& V_target = target.GetVertices();
+
+    Correspondences correspondences = FindCorrespondences(target, V_to_process, RejectionPolicy::Median(k), cache);
+
+    // Copy the kept pairs out for callers working on matched matrices
+    Eigen::MatrixXd V_refined_out(correspondences.Size(), 3);
+    Eigen::MatrixXd V_refined_raw(correspondences.Size(), 3);
+
+    for (size_t i = 0; i < correspondences.Size(); i++){
+        V_refined_out.row(i) = V_target.row(correspondences.target[i]);
+        V_refined_raw.row(i) = V_to_process.row(correspondences.source[i]);
+    }
+
+    return std::pair<Eigen::MatrixXd, Eigen::MatrixXd>(V_refined_out, V_refined_raw);
+}
+
+std::pair<std::pair<Eigen::MatrixXd, Eigen::MatrixXd>, Eigen::MatrixXd> ICP::FindCorrespondencesNormalBased(const Eigen::Ref<const Eigen::MatrixXd>& V_target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const Eigen::Ref<const Eigen::MatrixXd>& N_target){
+    return FindCorrespondencesNormalBased(Target(V_target), V_to_process, N_target);
+}
+
+std::pair<std::pair<Eigen::MatrixXd, Eigen::MatrixXd>, Eigen::MatrixXd> ICP::FindCorrespondencesNormalBased(const Target& target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const Eigen::Ref<const Eigen::MatrixXd>& N_target, CorrespondenceCache* cache){
+
+    // #Input: V1, V2, N1 (Without Rejection)
+    // #Output: V1_Matched, N1_Matched, V2_Matched (With Rejection)
+
+    const double k = 1.0;
+    const Eigen::MatrixXd& V_target = target.GetVertices();
+
+    Correspondences correspondences = FindCorrespondences(target, V_to_process, RejectionPolicy::Median(k), cache);
+
+    Eigen::MatrixXd V_refined_out(correspondences.Size(), 3);
+    Eigen::MatrixXd V_refined_raw(correspondences.Size(), 3);
+    Eigen::MatrixXd N_refined_out(correspondences.Size(), 3);
+
+    for (size_t i = 0; i < correspondences.Size(); i++){
+        V_refined_out.row(i) = V_target.row(correspondences.target[i]);
+        V_refined_raw.row(i) = V_to_process.row(correspondences.source[i]);
+        N_refined_out.row(i) = N_target.row(correspondences.target[i]);
+    }
+
+    std::pair<Eigen::MatrixXd, Eigen::MatrixXd> refined_target (V_refined_out, N_refined_out);
+
+    return std::pair<std::pair<Eigen::MatrixXd, Eigen::MatrixXd>, Eigen::MatrixXd> (refined_target, V_refined_raw);
+
+}
+
+ICP::PointToPointSums ICP::GetPairSums(const Eigen::Ref<const Eigen::MatrixXd>& V_target, const Eigen::Ref<const Eigen::MatrixXd>& V_source){
+
+    // #Input: V1_Matched, V2_Matched
+    // #Output: Sums over the pairs
+
+    PointToPointSums sums;
+    if (V_source.rows() == 0){
+        return sums;
+    }
+    sums.origin = V_source.row(0);
+
+    const double n = V_source.rows();
+    const Eigen::RowVector3d& o = sums.origin;
+    Eigen::RowVector3d p_total = V_target.colwise().sum();
+    Eigen::RowVector3d q_total = V_source.colwise().sum();
+
+    sums.count = V_source.rows();
+    sums.weight = n;
+    sums.sum_p = p_total - n * o;
+    sums.sum_q = q_total - n * o;
+
+    // Moments about o from the raw ones: Sigma (q - o)^T (p - o) = Q^T P - o^T Sigma p - (Sigma q)^T o + n o^T o
+    sums.sum_qp = V_source.transpose() * V_target - o.transpose() * p_total - q_total.transpose() * o + n * o.transpose() * o;
+    sums.sum_pp = V_target.squaredNorm() - 2 * o.dot(p_total) + n * o.squaredNorm();
+    sums.sum_qq = V_source.squaredNorm() - 2 * o.dot(q_total) + n * o.squaredNorm();
+
+    return sums;
+}
+
+std::pair<double, std::pair<Eigen::Matrix3d, Eigen::RowVector3d>> ICP::EstimateRigidTransform(const Eigen::Ref<const Eigen::MatrixXd>& V_matched, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process){
+
+    // #Input: V1_Matched, V2_Matched
+    // #Output: R, T
+
+    return EstimateRigidTransform(GetPairSums(V_matched, V_to_process));
+}
+
+std::pair<double, std::pair<Eigen::Matrix3d, Eigen::RowVector3d>> ICP::EstimateRigidTransform(const Eigen::Ref<const Eigen::MatrixXd>& V_target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const Correspondences& correspondences){
+
+    // #Input: V1, V2, Index pairs (V2 -> V1) and weights
+    // #Output: Error, R, T
+
+    // Same estimate as above, read through the index pairs instead of matched copies
+    PointToPointSums sums;
+    if (V_to_process.rows() > 0){
+        sums.origin = V_to_process.row(0);
+    }
+
+    for (size_t i = 0; i < correspondences.Size(); i++){
+        sums.Add(V_target.row(correspondences.target[i]), V_to_process.row(correspondences.source[i]), correspondences.weights[i]);
+    }
+
+    return EstimateRigidTransform(sums);
+}
+
+std::pair<double, std::pair<Eigen::Matrix3d, Eigen::RowVector3d>> ICP::EstimateRigidTransform(const PointToPointSums& sums){
+
+    // #Input: Sums over the matched pairs
+    // #Output: Error, R, T
+
+    // The rigid transform can be estimated from min(R,t) Sigma_i ||p_i - R*q_i - t||^2
+    // t = p_bar - R*q_bar
+    // R can be estimated from min(R) Sigma_i ||p_hat_i - R* q_hat_i||^2
+
+    std::pair<Eigen::Matrix3d, Eigen::RowVector3d> transform(Eigen::Matrix3d::Identity(), Eigen::RowVector3d::Zero());
+
+    if (sums.weight <= 0){
+        return std::pair<double, std::pair<Eigen::Matrix3d, Eigen::RowVector3d>> (0.0, transform);
+    }
+
+    // Barycenters, still relative to the origin of the sums
+    Eigen::RowVector3d p_bar = sums.sum_p / sums.weight;
+    Eigen::RowVector3d q_bar = sums.sum_q / sums.weight;
+
+    // A = Sigma_i q_hat_i * p_hat_i^T
+    Eigen::Matrix3d A = sums.GetCrossCovariance();
+
+    // Fixed-size 3x3 SVD, nothing is allocated
+    Eigen::JacobiSVD<Eigen::Matrix3d> svd(A, Eigen::ComputeFullU | Eigen::ComputeFullV);
+
+    // Flip the axis of the smallest singular value if V * U^T is a reflection
+    Eigen::Matrix3d D = Eigen::Matrix3d::Identity();
+    D(2,2) = (svd.matrixV() * svd.matrixU().transpose()).determinant() < 0 ? -1.0 : 1.0;
+
+    Eigen::Matrix3d R = svd.matrixV() * D * svd.matrixU().transpose();
+
+    // p = R (q - o) + (p_bar - R q_bar) + o
+    Eigen::RowVector3d T = p_bar - (R * q_bar.transpose()).transpose() + sums.origin - (R * sums.origin.transpose()).transpose();
+
+    transform.first = R;
+    transform.second = T;
+
+    // Sigma_i ||p_hat_i - R q_hat_i||^2 = Sigma_i ||p_hat_i||^2 + Sigma_i ||q_hat_i||^2 - 2 trace(R * A)
+    double p_hat_sqr = sums.sum_pp - sums.sum_p.squaredNorm() / sums.weight;
+    double q_hat_sqr = sums.sum_qq - sums.sum_q.squaredNorm() / sums.weight;
+    double error_metric = std::max(0.0, p_hat_sqr + q_hat_sqr - 2 * (R * A).trace()) / sums.weight;
+
+    return std::pair<double, std::pair<Eigen::Matrix3d, Eigen::RowVector3d>> (error_metric, transform);
+}
+
+// Linearised point-to-plane solution x = (alpha beta gamma t_x t_y t_z) -> R, T
+static std::pair<Eigen::Matrix3d, Eigen::RowVector3d> GetTransformFromAngles(const Eigen::Matrix<double, 6, 1>& x){
+
+    // Compute rigid transform R and T
+    Eigen::Matrix3d R;
+    R.setZero();
+
+    double sin_alpha = sin(x(0));
+    double cos_alpha = cos(x(0));
+    double sin_beta = sin(x(1));
+    double cos_beta = cos(x(1));
+    double sin_gamma = sin(x(2));
+    double cos_gamma = cos(x(2));
+    R(0,0) = cos_gamma * cos_beta;
+    R(0,1) = -sin_gamma * cos_alpha + cos_gamma * sin_beta * sin_alpha;
+    R(0,2) = sin_gamma * sin_alpha + cos_gamma * sin_beta * cos_alpha;
+    R(1,0) = sin_gamma * cos_beta;
+    R(1,1) = cos_gamma * cos_alpha + sin_gamma * sin_beta * sin_alpha;
+    R(1,2) = -cos_gamma * sin_alpha + sin_gamma * sin_beta * cos_alpha;
+    R(2,0) = -sin_beta;
+    R(2,1) = cos_beta * sin_alpha;
+    R(2,2) = cos_beta * cos_alpha;
+
+    Eigen::RowVector3d T(x(3),x(4),x(5));
 
-    // #Input: V1
-    // #Output: N1
+    return std::pair<Eigen::Matrix3d, Eigen::RowVector3d>(R,T);
+}
 
-    // p <-matched q<-to process
-    Eigen::MatrixXd VN_out;
-    VN_out.resize(V_target.rows(),V_target.cols());
-    VN_out.setZero();
+std::pair<Eigen::Matrix3d, Eigen::RowVector3d> ICP::EstimateRigidTransformNormalBased(const Eigen::Ref<const Eigen::MatrixXd>& V_matched, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const Eigen::Ref<const Eigen::MatrixXd>& N_to_process){
 
-    const size_t num_result = 20; // 4 or 8
-    const size_t max_leaf = 50;
+    // #Input: V1_Matched, V2_Matched, N1_Matched
+    // #Output: R, T
 
-    //Eigen::RowVector3d center;
-    Eigen::MatrixXd center(1,3);
-    center = V_target.colwise().sum()/ double(V_target.rows());
+    PointToPlaneSums sums;
 
-    // Generate the KD tree with nanoflann
-    nanoflann::KDTreeEigenMatrixAdaptor<Eigen::MatrixXd> kd_tree_index(V_target, max_leaf);
-    kd_tree_index.index->buildIndex();
+    for (size_t i = 0; i < V_matched.rows(); i++){
+        sums.Add(V_matched.row(i), N_to_process.row(i), V_to_process.row(i));
+    }
 
-    // For each vertex
-    for (size_t v=0; v<VN_out.rows(); v++) {
+    return EstimateRigidTransformNormalBased(sums);
 
-        // Pick the current vertex for query
-        Eigen::RowVector3d query_vertex = V_target.row(v);
+}
 
-        // Create a query object
-        std::vector<size_t> indexes(num_result);
-        std::vector<double> dists_sqr(num_result);
+std::pair<Eigen::Matrix3d, Eigen::RowVector3d> ICP::EstimateRigidTransformNormalBased(const Eigen::Ref<const Eigen::MatrixXd>& V_target, const Eigen::Ref<const Eigen::MatrixXd>& N_target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const Correspondences& correspondences){
 
-        // Find the closest 1 vertex
-        nanoflann::KNNResultSet<double> result(num_result);
-        result.init(indexes.data(), dists_sqr.data());
-        kd_tree_index.index->findNeighbors(result, query_vertex.data(), nanoflann::SearchParams(max_leaf));
+    // #Input: V1, N1, V2, Index pairs (V2 -> V1) and weights
+    // #Output: R, T
 
-        // Assign founded vertex to output matrix
-        Eigen::MatrixXd V_founded(num_result, 3);
-        for (size_t i = 0; i < num_result; i++){
-            V_founded.row(i) = V_target.row(indexes[i]);
-        }
+    // Same system as above, read through the index pairs
+    return EstimateRigidTransformNormalBased(GetPointToPlaneSums(V_target, N_target, V_to_process, correspondences));
+}
 
-        Eigen::RowVector3d N, C;
-        igl::fit_plane(V_founded, N, C);
+ICP::PointToPlaneSums ICP::GetPointToPlaneSums(const Eigen::Ref<const Eigen::MatrixXd>& V_target, const Eigen::Ref<const Eigen::MatrixXd>& N_target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const Correspondences& correspondences, const std::pair<Eigen::Matrix3d, Eigen::RowVector3d>* transform){
 
-        VN_out.row(v) = N;
+    // #Input: V1, N1, V2, Index pairs (V2 -> V1) and weights
+    // #Output: Normal equations
 
-        // Flip normal if pointing to the wrong direction
-        if((center(0,0)-V_target(v,0)) * VN_out(v,0) + (center(0,1)-V_target(v,1)) * VN_out(v,1) + (center(0,2)-V_target(v,2)) * VN_out(v,2) > 0) {
-            VN_out.row(v) = -VN_out.row(v);
-        }
-    }
+    const size_t min_parallel = 1000;
+    PointToPlaneSums sums;
+    std::vector<PointToPlaneSums> partial_sums;
 
-    return VN_out;
+    igl::parallel_for(correspondences.Size(), [&](const size_t num_threads){
+        partial_sums.assign(num_threads, PointToPlaneSums());
+    }, [&](const int i, const size_t t){
+        size_t target_i = correspondences.target[i];
+        partial_sums[t].Add(V_target.row(target_i), N_target.row(target_i), GetMovedVertex(V_to_process, correspondences.source[i], transform), correspondences.weights[i]);
+    }, [&](const size_t t){
+        sums.Add(partial_sums[t]);
+    }, GetMinParallel(min_parallel));
 
+    return sums;
 }
 
-std::pair<Eigen::MatrixXi, Eigen::MatrixXi> ICP::FindNonOverlappingFaces(Eigen::MatrixXd V_target, Eigen::MatrixXd V_to_process, Eigen::MatrixXi F_to_process){
+void ICP::PointToPlaneSums::Add(const Eigen::RowVector3d& p, const Eigen::RowVector3d& n, const Eigen::RowVector3d& q, double w){
 
-    // Initialise output matrix
-    std::vector<int> V_distant;
-    std::vector<Eigen::Vector3i> F_raw;
-    Eigen::MatrixXi F_non_overlap(0,3);
-    Eigen::MatrixXi F_overlap(0,3);
-    Eigen::Vector3i empty (-1,-1,-1);
-    
-    const size_t num_result = 1;
-    const size_t max_leaf = 10;
-    const double threshold = 0.00001;
+    // Reference slide: http://resources.mpi-inf.mpg.de/deformableShapeMatching/EG2011_Tutorial/slides/2.1%20Rigid%20ICP.pdf Page 12
 
-    // Generate the KD tree with nanoflann
-    nanoflann::KDTreeEigenMatrixAdaptor<Eigen::MatrixXd> kd_tree_index(V_target, max_leaf);
-    kd_tree_index.index->buildIndex();
+    // A = p_i x n_i, n_i
+    // b = -(p_i - q_i) . n_i
+    Eigen::Matrix<double, 6, 1> a;
+    a << p.cross(n).transpose(), n.transpose();
+    double b = n.dot(p - q);
+
+    count++;
+    weight += w;
+    AtA.noalias() += w * a * a.transpose();
+    Atb += w * b * a;
+    btb += w * b * b;
+}
 
-    // For each vertex
-    for (size_t v=0; v<V_to_process.rows(); v++){
+void ICP::PointToPlaneSums::Add(const PointToPlaneSums& other){
+    count += other.count;
+    weight += other.weight;
+    AtA += other.AtA;
+    Atb += other.Atb;
+    btb += other.btb;
+}
 
-        // Pick the current vertex for query
-        Eigen::RowVector3d query_vertex = V_to_process.row(v);
+double ICP::PointToPlaneSums::GetError() const{
+    return weight > 0 ? btb / weight : 0.0;
+}
 
-        // Create a query object
-        std::vector<size_t> indexes(num_result);
-        std::vector<double> dists_sqr(num_result);
+std::pair<Eigen::Matrix3d, Eigen::RowVector3d> ICP::EstimateRigidTransformNormalBased(const PointToPlaneSums& sums){
 
-        // Find the closest 1 vertex
-        nanoflann::KNNResultSet<double> result(num_result);
-        result.init(indexes.data(), dists_sqr.data());
-        kd_tree_index.index->findNeighbors(result, query_vertex.data(), nanoflann::SearchParams(max_leaf));
-
-        // Check if it is distant
-        if (dists_sqr[0] > threshold){
-            V_distant.push_back(v);
-        }
-    }
-
-    for (size_t f=0; f<F_to_process.rows(); f++){
-        F_raw.push_back(F_to_process.row(f));
-    }
-
-    // Construct the non-overlapping face list
-    for (size_t f=0; f<F_raw.size(); f++){
-        
-        for (size_t i=0; i < V_distant.size(); i ++){
-            
-            for (size_t k=0; k<F_raw[f].size(); k++){
-                
-                if (F_raw[f][k] == V_distant[i]){
-                    
-                    F_non_overlap.conservativeResize(F_non_overlap.rows()+1, 3);
-                    
-                    F_non_overlap.row(F_non_overlap.rows()-1) = F_to_process.row(f);
-                    
-                    F_raw[f] = empty;
-                    
-                    break;
-                }
-            }
-        }
-    }
+    // #Input: Normal equations of the matched pairs
+    // #Output: R, T
 
-    // Construct the overlapping face list
-    for (size_t i=0; i <F_raw.size(); i++){
-        if (F_raw[i] != empty){
-            F_overlap.conservativeResize(F_overlap.rows()+1, 3);
-            F_overlap.row(F_overlap.rows()-1) = F_raw[i];
-        }
+    // Solve x
+    // x = (alpha beta gamma t_x t_y t_z)'T
+    Eigen::Matrix<double, 6, 1> x = Eigen::Matrix<double, 6, 1>::Zero();
+    if (sums.count > 0){
+        x = sums.AtA.ldlt().solve(sums.Atb);
     }
 
-    // Output
-    return std::pair<Eigen::MatrixXi, Eigen::MatrixXi>(F_overlap, F_non_overlap);
-    
+    return GetTransformFromAngles(x);
 }
 
-Eigen::MatrixXd ICP::Rotate(Eigen::MatrixXd V_in, double x, double y, double z){
-    
-    // Initialise
-    Eigen::MatrixXd V_out;
-    V_out.resize(V_in.rows(), V_in.cols());
-    V_out.setZero();
-    
-    // Construct rotation matrix
-    Eigen::Matrix3d R;
-    R = Eigen::AngleAxisd(x * M_PI/180, Eigen::Vector3d::UnitX()) * Eigen::AngleAxisd(y * M_PI/180, Eigen::Vector3d::UnitY()) * Eigen::AngleAxisd(z * M_PI/180, Eigen::Vector3d::UnitZ());
-    
-    // Rotate the vertex
-    V_out = V_in * R;
-    
-    return V_out;
-    
-}
+void ICP::GeneralisedSums::Add(const Eigen::RowVector3d& residual, const Eigen::RowVector3d& q, const Eigen::Matrix3d& M, double w){
 
-Eigen::MatrixXd ICP::AddNoise(Eigen::MatrixXd V_in, double sd){
-    
-    // Initialise output matrix
-    Eigen::MatrixXd V_out;
-    V_out.resize(V_in.rows(), V_in.cols());
-    V_out.setZero();
+    // d(x) ~ r + J x with x = (omega, t) a small rotation and translation of q, J = ([q]x, -I)
+    Eigen::Matrix<double, 3, 6> J;
+    J << 0, -q.z(), q.y(), -1, 0, 0,
+         q.z(), 0, -q.x(), 0, -1, 0,
+         -q.y(), q.x(), 0, 0, 0, -1;
 
-    Eigen::MatrixXd V_bounding;
-    Eigen::MatrixXi F_bounding;
+    Eigen::Matrix<double, 6, 3> JtM = J.transpose() * M;
 
-    igl::bounding_box(V_in, V_bounding, F_bounding);
-    double noise_scale_x = abs(V_bounding.row(0).x()-V_bounding.row(4).x());
-    double noise_scale_y = abs(V_bounding.row(0).y()-V_bounding.row(2).y());
-    double noise_scale_z = abs(V_bounding.row(0).z()-V_bounding.row(1).z());
+    count++;
+    weight += w;
+    H.noalias() += w * JtM * J;
+    g.noalias() += w * JtM * residual.transpose();
+    error += w * residual * M * residual.transpose();
+}
 
-    // Random number generation
-    std::default_random_engine rnd;
-    std::normal_distribution<double> gaussian(0.0, sd);
-    
-    // Add noise to the vertex
-    for (int i=0; i<V_out.rows(); i++){
-        double x =gaussian(rnd)/(10000*noise_scale_x);
-        double y =gaussian(rnd)/(10000*noise_scale_y);
-        double z =gaussian(rnd)/(10000*noise_scale_z);
-        Eigen::RowVector3d noise(x,y,z);
-        V_out.row(i) = V_in.row(i) + noise;
-    }
-    
-    return V_out;
-    
+void ICP::GeneralisedSums::Add(const GeneralisedSums& other){
+    count += other.count;
+    weight += other.weight;
+    H += other.H;
+    g += other.g;
+    error += other.error;
 }
 
-Eigen::MatrixXd ICP::FindBestStartRotation(Eigen::MatrixXd V_target, Eigen::MatrixXd V_to_process){
-    const int rotate_degree = 120;
-    std::vector<Eigen::MatrixXd> V_rotate_list;
-    std::vector<double> distance_list;
-    //Eigen::RowVector3d center_target = V_target.colwise().sum()/V_target.rows();
-    // Apply a 0(360), 120 , 240 rotation for each axis (not at the same time)
-    for (int x = 0; x < 3; x++){
-        for (int y = 0; y < 3; y++){
-            for (int z = 0; z < 3; z ++){
-                Eigen::MatrixXd V_rotated = Rotate(V_to_process, x*120, y*120, z*120);
-                V_rotate_list.push_back(V_rotated);
-                Eigen::MatrixXd V_matched = FindCorrespondences(V_target, V_rotated).first;
-                Eigen::RowVector3d center_matched = V_matched.colwise().sum()/V_matched.rows();
-                Eigen::RowVector3d center_rotated = V_rotated.colwise().sum()/V_rotated.rows();
-                double distance = (center_matched-center_rotated).norm();
-                distance_list.push_back(distance);
-            }
-        }
-    }
+std::pair<double, std::pair<Eigen::Matrix3d, Eigen::RowVector3d>> ICP::EstimateRigidTransformGeneralised(const Target& target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const std::vector<Eigen::Matrix3d>& C_to_process, const Eigen::Matrix3d& R_to_process, const Correspondences& correspondences, int max_step){
 
-    // Find the one with the rotated one with smallest euclidean distance
-    size_t min = std::min_element(distance_list.begin(),distance_list.end()) - distance_list.begin();
-    return V_rotate_list[min];
-}
+    // #Input: V1 (with covariances), V2, C2, Index pairs (V2 -> V1) and weights
+    // #Output: Error, R, T
 
-std::pair<Eigen::MatrixXd, Eigen::MatrixXd> ICP::FindCorrespondences(Eigen::MatrixXd V_target, Eigen::MatrixXd V_to_process){
+    // Generalized-ICP, Segal et al. 2009
+    // min(R,t) Sigma_i d_i^T (C_p_i + R C_q_i R^T)^-1 d_i, d_i = p_i - R q_i - t
 
-    // #Input: V1, V2 (Without Rejection)
-    // #Output: V1_Matched, V2_Matched (With Rejection)
+    const Eigen::MatrixXd& V_target = target.GetVertices();
+    const std::vector<Eigen::Matrix3d>& C_target = target.GetCovariances();
 
-    // Initialise output matrix
-    Eigen::MatrixXd V_out;
-    std::vector<double> distances, distances_raw;
-    V_out.resize(V_to_process.rows(), V_to_process.cols());
-    V_out.setZero();
+    const size_t min_parallel = 1000;
 
-    std::vector<int> refined_index;
+    std::pair<Eigen::Matrix3d, Eigen::RowVector3d> transform(Eigen::Matrix3d::Identity(), Eigen::RowVector3d::Zero());
+    double error_metric = 0;
 
-    const double k = 2.0;
-    const size_t num_result = 1;
-    const size_t max_leaf = 20;
+    // Gauss-Newton on SE(3): linearise around the current step, solve the 6x6 system and compose the update
+    for (int step = 0; step < max_step; step++){
 
-    double distance_median;
+        GeneralisedSums sums;
+        std::vector<GeneralisedSums> partial_sums;
 
-    //std::cout << "Unprocessed size:" + std::to_string(V_to_process.rows()) << std::endl;
+        // Both covariances in the current pose of the source
+        Eigen::Matrix3d R_current = transform.first * R_to_process;
 
+        igl::parallel_for(correspondences.Size(), [&](const size_t num_threads){
+            partial_sums.assign(num_threads, GeneralisedSums());
+        }, [&](const int i, const size_t t){
 
-    // Generate the KD tree with nanoflann
-    nanoflann::KDTreeEigenMatrixAdaptor<Eigen::MatrixXd> kd_tree_index(V_target, max_leaf);
-    kd_tree_index.index->buildIndex();
+            size_t target_i = correspondences.target[i];
+            size_t source_i = correspondences.source[i];
 
-    // For each vertex
-    for (size_t v=0; v<V_out.rows(); v++){
+            Eigen::RowVector3d q = (transform.first * V_to_process.row(source_i).transpose()).transpose() + transform.second;
+            Eigen::RowVector3d residual = V_target.row(target_i) - q;
+            Eigen::Matrix3d M = (C_target[target_i] + R_current * C_to_process[source_i] * R_current.transpose()).inverse();
 
-        // Pick the current vertex for query
-        Eigen::RowVector3d query_vertex = V_to_process.row(v);
+            partial_sums[t].Add(residual, q, M, correspondences.weights[i]);
 
-        // Create a query object
-        std::vector<size_t> indexes(num_result);
-        std::vector<double> dists_sqr(num_result);
+        }, [&](const size_t t){
+            sums.Add(partial_sums[t]);
+        }, GetMinParallel(min_parallel));
 
-        // Find the closest 1 vertex
-        nanoflann::KNNResultSet<double> result(num_result);
-        result.init(indexes.data(), dists_sqr.data());
-        kd_tree_index.index->findNeighbors(result, query_vertex.data(), nanoflann::SearchParams(max_leaf));
+        if (sums.count == 0){
+            break;
+        }
+
+        error_metric = sums.error / sums.weight;
+
+        Eigen::Matrix<double, 6, 1> x = -sums.H.ldlt().solve(sums.g);
+
+        // Exponential map of the small rotation, applied on top of the current step
+        Eigen::Vector3d omega = x.head<3>();
+        Eigen::Matrix3d R_delta = Eigen::Matrix3d::Identity();
+        if (omega.norm() > 0){
+            R_delta = Eigen::AngleAxisd(omega.norm(), omega.normalized()).toRotationMatrix();
+        }
+        Eigen::RowVector3d T_delta = x.tail<3>().transpose();
 
-        // Assign founded vertex to output matrix
-        V_out.row(v) = V_target.row(indexes[0]);
-        distances.push_back(dists_sqr[0]);
+        transform = ComposeRigidTransform(transform, std::pair<Eigen::Matrix3d, Eigen::RowVector3d>(R_delta, T_delta));
 
+        // The linearisation is exact enough, stop refining
+        if (x.norm() < 1e-12){
+            break;
+        }
     }
 
-    distances_raw = distances;
+    return std::pair<double, std::pair<Eigen::Matrix3d, Eigen::RowVector3d>> (error_metric, transform);
+}
 
-    // The pairs rejection can be done using k * median distance
-    // Reference slide: http://resources.mpi-inf.mpg.de/deformableShapeMatching/EG2011_Tutorial/slides/2.1%20Rigid%20ICP.pdf Page 8
+ICP::AndersonAcceleration::AndersonAcceleration(int window):window(window){}
 
-    // Find median distance value
-    std::sort(distances.begin(),distances.end());
+std::pair<Eigen::Matrix3d, Eigen::RowVector3d> ICP::AndersonAcceleration::Update(double energy, const std::pair<Eigen::Matrix3d, Eigen::RowVector3d>& current, const std::pair<Eigen::Matrix3d, Eigen::RowVector3d>& plain){
 
-    if (distances.size() % 2 == 0){
-        distance_median = (distances[distances.size()/2-1]+distances[distances.size()/2])/2;
-    }else{
-        distance_median = distances[distances.size()/2];
+    if (window <= 0){
+        return plain;
     }
 
-    for (int i = 0; i < distances_raw.size(); i++){
-        if (distances_raw[i] <= k * distance_median){
-            refined_index.push_back(i);
-        }else{
-            // Distant vertex, ignore.
-        }
+    // Safeguard: the extrapolated pose made things worse, go back to the plain pose it replaced and start over
+    if (accelerated && energy > last_energy){
+        accelerated = false;
+        rejections++;
+        G.clear();
+        F.clear();
+        return last_plain;
     }
 
-    Eigen::MatrixXd V_refined_out(refined_index.size(), 3);
-    Eigen::MatrixXd V_refined_raw(refined_index.size(), 3);
+    last_energy = energy;
+    last_plain = plain;
+
+    // u = (rotation vector, translation)
+    auto to_vector = [](const std::pair<Eigen::Matrix3d, Eigen::RowVector3d>& transform){
+        Eigen::AngleAxisd rotation(transform.first);
+        Vector6d u;
+        u << rotation.angle() * rotation.axis(), transform.second.transpose();
+        return u;
+    };
+
+    Vector6d g = to_vector(plain);
+    Vector6d f = g - to_vector(current);
+
+    G.push_back(g);
+    F.push_back(f);
+    if (G.size() > size_t(window) + 1){
+        G.erase(G.begin());
+        F.erase(F.begin());
+    }
 
-    for (int i = 0; i < refined_index.size(); i++){
-        V_refined_out.row(i) = V_out.row(refined_index[i]);
-        V_refined_raw.row(i) = V_to_process.row(refined_index[i]);
+    // Nothing to extrapolate from yet
+    if (G.size() < 2){
+        accelerated = false;
+        return plain;
     }
 
-    //std::cout << "V_refined" + std::to_string(V_refined_out.rows()) << std::endl;
+    // min(theta) ||f - dF theta||, then u = g - dG theta
+    size_t m = G.size() - 1;
+    Eigen::Matrix<double, 6, Eigen::Dynamic> dG(6, m), dF(6, m);
+    for (size_t i = 0; i < m; i++){
+        dG.col(i) = G[i+1] - G[i];
+        dF.col(i) = F[i+1] - F[i];
+    }
+    Eigen::VectorXd theta = dF.colPivHouseholderQr().solve(f);
+    Vector6d u = g - dG * theta;
 
-    return std::pair<Eigen::MatrixXd, Eigen::MatrixXd>(V_refined_out, V_refined_raw);
+    double angle = u.head<3>().norm();
+    Eigen::Matrix3d R = Eigen::Matrix3d::Identity();
+    if (angle > 0){
+        R = Eigen::AngleAxisd(angle, u.head<3>() / angle).toRotationMatrix();
+    }
 
-    //return std::pair<Eigen::MatrixXd, Eigen::MatrixXd>(V_out, V_to_process);
+    accelerated = true;
+    return std::pair<Eigen::Matrix3d, Eigen::RowVector3d>(R, u.tail<3>().transpose());
 }
 
-std::pair<std::pair<Eigen::MatrixXd, Eigen::MatrixXd>, Eigen::MatrixXd> ICP::FindCorrespondencesNormalBased(Eigen::MatrixXd V_target, Eigen::MatrixXd V_to_process, Eigen::MatrixXd N_target){
+int ICP::AndersonAcceleration::Rejections() const{
+    return rejections;
+}
 
-    // #Input: V1, V2, N1 (Without Rejection)
-    // #Output: V1_Matched, N1_Matched, V2_Matched (With Rejection)
+Eigen::MatrixXd ICP::ApplyRigidTransform(const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const std::pair<Eigen::Matrix3d, Eigen::RowVector3d>& transform){
+    Eigen::MatrixXd V_out;
+    ApplyRigidTransform(V_to_process, transform, V_out);
+    return V_out;
+}
 
-    // Initialise output matrix
-    Eigen::MatrixXd V_out, N_out;
-    std::vector<double> distances, distances_raw;
+void ICP::ApplyRigidTransform(const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const std::pair<Eigen::Matrix3d, Eigen::RowVector3d>& transform, Eigen::MatrixXd& V_out){
+
+    // #Input: V2, R, T
+    // #Output: V2_Transformed
+
+    // According to the formula, p = Rq + t, i.e. V R^T + t for row vertices
+    // The columns of an N x 3 matrix are contiguous, so this is one vectorised product instead of a loop over strided rows
     V_out.resize(V_to_process.rows(), V_to_process.cols());
-    V_out.setZero();
+    V_out.noalias() = V_to_process * transform.first.transpose();
+    V_out.rowwise() += transform.second;
+}
 
-    N_out.resize(V_to_process.rows(), V_to_process.cols());
-    N_out.setZero();
+std::pair<Eigen::Matrix3d, Eigen::RowVector3d> ICP::ComposeRigidTransform(std::pair<Eigen::Matrix3d, Eigen::RowVector3d> first, std::pair<Eigen::Matrix3d, Eigen::RowVector3d> second){
 
-    std::vector<int> refined_index;
+    // p = R2 * (R1 * q + t1) + t2
+    Eigen::Matrix3d R = second.first * first.first;
+    Eigen::RowVector3d T = (second.first * first.second.transpose()).transpose() + second.second;
 
-    const double k = 1.0;
-    const size_t num_result = 1;
-    const size_t max_leaf = 20;
+    return std::pair<Eigen::Matrix3d, Eigen::RowVector3d>(R, T);
+}
 
-    double distance_median;
+std::pair<Eigen::Matrix3d, Eigen::RowVector3d> ICP::ICPPyramid(const TargetPyramid& pyramid, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const RejectionPolicy& policy, const ConvergenceCriteria& criteria, std::vector<Convergence>* convergences){
 
-    // Generate the KD tree with nanoflann
-    nanoflann::KDTreeEigenMatrixAdaptor<Eigen::MatrixXd> kd_tree_index(V_target, max_leaf);
-    kd_tree_index.index->buildIndex();
+    // #Input: V1 (Pyramid), V2
+    // #Output: R, T (V2 -> V1)
 
-    // For each vertex
-    for (size_t v=0; v<V_out.rows(); v++){
+    std::pair<Eigen::Matrix3d, Eigen::RowVector3d> transform(Eigen::Matrix3d::Identity(), Eigen::RowVector3d::Zero());
 
-    // Pick the current vertex for query
-    Eigen::RowVector3d query_vertex = V_to_process.row(v);
+    if (convergences){
+        convergences->clear();
+    }
+    auto start_time = std::chrono::steady_clock::now();
 
-    // Create a query object
-    std::vector<size_t> indexes(num_result);
-    std::vector<double> dists_sqr(num_result);
+    for (int level = pyramid.Levels() - 1; level >= 0; level--){
 
-    // Find the closest 1 vertex
-    nanoflann::KNNResultSet<double> result(num_result);
-    result.init(indexes.data(), dists_sqr.data());
-    kd_tree_index.index->findNeighbors(result, query_vertex.data(), nanoflann::SearchParams(max_leaf));
+        // Each level gets what is left of the time budget
+        ConvergenceCriteria level_criteria = criteria;
+        if (criteria.time_budget > 0){
+            level_criteria.time_budget = criteria.time_budget - std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+            if (level_criteria.time_budget <= 0){
+                break;
+            }
+        }
 
-    // Assign founded vertex to output matrix
-    V_out.row(v) = V_target.row(indexes[0]);
-    N_out.row(v) = N_target.row(indexes[0]);
-    distances.push_back(dists_sqr[0]);
+        // Source at the same resolution as the target level, never moved: the passes move it by the accumulated transform
+        // The finest level reads the scan in place
+        Eigen::MatrixXd V_subsampled = level > 0 ? GetVoxelSubsample(V_to_process, pyramid.GetVoxelSize(level)) : Eigen::MatrixXd(0, 3);
+        Eigen::Ref<const Eigen::MatrixXd> V_level = level > 0 ? Eigen::Ref<const Eigen::MatrixXd>(V_subsampled) : V_to_process;
 
-    }
+        const Target& target = pyramid.GetLevel(level);
+        CorrespondenceCache cache;
+        Convergence convergence(level_criteria);
 
-    distances_raw = distances;
+        while (!convergence.Stopped()){
+            PointToPointSums sums = AccumulateCorrespondences(target, V_level, policy, &cache, &transform);
+            std::pair<double, std::pair<Eigen::Matrix3d, Eigen::RowVector3d>> transform_info = EstimateRigidTransform(sums);
 
-    // The pairs rejection can be done using k * median distance
-    // Reference slide: http://resources.mpi-inf.mpg.de/deformableShapeMatching/EG2011_Tutorial/slides/2.1%20Rigid%20ICP.pdf Page 8
+            transform = ComposeRigidTransform(transform, transform_info.second);
 
-    // Find median distance value
-    std::sort(distances.begin(),distances.end());
+            convergence.Update(transform_info.first, transform_info.second);
+        }
 
-    if (distances.size() % 2 == 0){
-    distance_median = (distances[distances.size()/2-1]+distances[distances.size()/2])/2;
-    }else{
-    distance_median = distances[distances.size()/2];
+        if (convergences){
+            convergences->push_back(convergence);
+        }
     }
 
-    for (int i = 0; i < distances_raw.size(); i++){
-    if (distances_raw[i] <= k * distance_median){
-    refined_index.push_back(i);
-    }else{
-    // Distant vertex, ignore.
-    }
+    return transform;
+}
+
+std::pair<Eigen::Matrix3d, Eigen::RowVector3d> ICP::ICPAccumulated(const Target& target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, double subsample_rate, const RejectionPolicy& policy, Convergence& convergence, AndersonAcceleration* anderson, std::mt19937* generate){
+
+    // #Input: V1 (Indexed), V2
+    // #Output: R, T (V2 -> V1)
+
+    std::pair<Eigen::Matrix3d, Eigen::RowVector3d> transform(Eigen::Matrix3d::Identity(), Eigen::RowVector3d::Zero());
+
+    // The cache needs the same source rows on every pass, so only the full scan can use it
+    CorrespondenceCache cache;
+    bool use_subsample = subsample_rate > 0;
+
+    while (!convergence.Stopped()){
+
+        // Only the subsample is read, and it is moved vertex by vertex inside the pass
+        PointToPointSums sums = use_subsample
+            ? AccumulateCorrespondences(target, GetSubsample(V_to_process, subsample_rate, generate), policy, nullptr, &transform)
+            : AccumulateCorrespondences(target, V_to_process, policy, &cache, &transform);
+        std::pair<double, std::pair<Eigen::Matrix3d, Eigen::RowVector3d>> transform_info = EstimateRigidTransform(sums);
+
+        std::pair<Eigen::Matrix3d, Eigen::RowVector3d> plain = ComposeRigidTransform(transform, transform_info.second);
+        transform = anderson ? anderson->Update(sums.GetError(), transform, plain) : plain;
+
+        convergence.Update(transform_info.first, transform_info.second);
     }
 
-    Eigen::MatrixXd V_refined_out(refined_index.size(), 3);
-    Eigen::MatrixXd V_refined_raw(refined_index.size(), 3);
-    Eigen::MatrixXd N_refined_out(refined_index.size(), 3);
+    return transform;
+}
+
+std::vector<ICP::Registration> ICP::RegisterBatch(const Target& target, const std::vector<Eigen::MatrixXd>& sources, const ConvergenceCriteria& criteria, double subsample_rate, const RejectionPolicy& policy, bool point_to_plane){
+
+    // #Input: V1 (Indexed), V2, V3, ...
+    // #Output: R, T (Vi -> V1) and the residual of every source
 
-    for (int i = 0; i < refined_index.size(); i++){
-    V_refined_out.row(i) = V_out.row(refined_index[i]);
-    V_refined_raw.row(i) = V_to_process.row(refined_index[i]);
-    N_refined_out.row(i) = N_out.row(refined_index[i]);
+    std::vector<Registration> registrations(sources.size());
+
+    // The sources carry no normals, a policy testing them is rejected here rather than inside a task
+    CheckNormalTest(policy, false);
+
+    // Estimated once here, otherwise the first task to need them would do it while the others wait
+    if (point_to_plane){
+        target.GetNormals();
     }
 
-    std::pair<Eigen::MatrixXd, Eigen::MatrixXd> refined_target (V_refined_out, N_refined_out);
+    // One source per task if the batch fills the cores, the passes of a task then run serially
+    // A smaller batch registers one source after the other with the passes spread over the cores instead
+    const size_t num_threads = std::max(1u, std::thread::hardware_concurrency());
+    const bool parallel_sources = sources.size() >= num_threads;
+
+    // Nothing is shared between the sources but the read-only target
+    igl::parallel_for(sources.size(), [&](const int s){
+        const Eigen::MatrixXd& V = sources[s];
+        Registration& registration = registrations[s];
+        registration.transform = std::pair<Eigen::Matrix3d, Eigen::RowVector3d>(Eigen::Matrix3d::Identity(), Eigen::RowVector3d::Zero());
+        if (target.Size() == 0 || V.rows() == 0){
+            return;
+        }
 
-    return std::pair<std::pair<Eigen::MatrixXd, Eigen::MatrixXd>, Eigen::MatrixXd> (refined_target, V_refined_raw);
+        // Each source subsamples from its own generator seeded by the source
+        SerialPasses serial(parallel_sources);
+        std::mt19937 generate(s);
+        Convergence convergence(criteria);
+
+        if (point_to_plane){
+            const Eigen::MatrixXd& N = target.GetNormals();
+            CorrespondenceCache cache;
+            std::vector<size_t> indexes;
+            std::vector<double> dists_sqr;
+
+            // V is moved by the pose so far as it is read, the sums are taken before this pass's step
+            while (!convergence.Stopped()){
+                FindClosestVertices(target, V, indexes, dists_sqr, cache, &registration.transform);
+                Correspondences correspondences = RejectCorrespondences(indexes, dists_sqr, policy);
+                PointToPlaneSums sums = GetPointToPlaneSums(target.GetVertices(), N, V, correspondences, &registration.transform);
+                std::pair<Eigen::Matrix3d, Eigen::RowVector3d> step = EstimateRigidTransformNormalBased(sums);
+                registration.transform = ComposeRigidTransform(registration.transform, step);
+                convergence.Update(sums.GetError(), step);
+            }
+        }else{
+            registration.transform = ICPAccumulated(target, V, subsample_rate, policy, convergence, nullptr, &generate);
+        }
 
+        // Point-to-point residual over the full source, whichever metric was minimised
+        PointToPointSums sums = AccumulateCorrespondences(target, V, policy, nullptr, &registration.transform);
+        registration.rms = std::sqrt(sums.GetError());
+        registration.inlier_ratio = double(sums.count) / V.rows();
+        registration.iterations = convergence.Iterations();
+        registration.reason = convergence.GetReason();
+    }, GetMinParallel(parallel_sources ? 1 : sources.size() + 1));
+
+    return registrations;
 }
 
-std::pair<double, std::pair<Eigen::Matrix3d, Eigen::RowVector3d>> ICP::EstimateRigidTransform(Eigen::MatrixXd V_matched, Eigen::MatrixXd V_to_process){
+std::vector<ICP::PoseGraphEdge> ICP::FindPoseGraphEdges(const std::vector<Target>& scans, const ConvergenceCriteria& criteria, double subsample_rate, double min_overlap){
 
-    // #Input: V1_Matched, V2_Matched
-    // #Output: R, T
+    // #Input: V1, V2, ... (Indexed)
+    // #Output: Relative transform of every overlapping pair
 
-    // The rigid transform can be estimated from min(R,t) Sigma_i ||p_i - R*q_i - t||^2
-    // t = p_bar - R*q_bar
-    // R can be estimated from min(R) Sigma_i ||p_hat_i - R* q_hat_i||^2
+    const size_t num_samples = 1000;
+    const size_t max_tie_vertices = 500;
+    const double overlap_threshold = 0.00001;
 
-    std::pair<Eigen::Matrix3d, Eigen::RowVector3d> transform;
+    std::vector<PoseGraphEdge> candidates;
+    for (size_t i = 0; i < scans.size(); i++){
+        for (size_t j = i + 1; j < scans.size(); j++){
+            PoseGraphEdge edge;
+            edge.i = i;
+            edge.j = j;
+            edge.transform = std::pair<Eigen::Matrix3d, Eigen::RowVector3d>(Eigen::Matrix3d::Identity(), Eigen::RowVector3d::Zero());
+            candidates.push_back(edge);
+        }
+    }
 
-    // Define Barycenters
-    // p_bar = 1/m sigma p_i => average
-    Eigen::RowVector3d p_bar = V_matched.colwise().mean();
-    Eigen::RowVector3d q_bar = V_to_process.colwise().mean();
+    // One pair per task, the pairs share the read-only indexes
+    igl::parallel_for(candidates.size(), [&](const int c){
+        PoseGraphEdge& edge = candidates[c];
+        const Target& target = scans[edge.i];
+        const Eigen::MatrixXd& V_j = scans[edge.j].GetVertices();
+        if (target.Size() == 0 || V_j.rows() == 0){
+            return;
+        }
 
-    Eigen::MatrixXd p_hat = V_matched.rowwise() - p_bar;
-    Eigen::MatrixXd q_hat = V_to_process.rowwise() - q_bar;
+        // Same as a batch task, every pass of the pair (the overlap tests included) runs serially,
+        // and the subsample is drawn from a generator seeded by the pair
+        SerialPasses serial;
 
-    // Construct A
-    Eigen::Matrix3d A;
-    A.setZero();
+        // Evenly spread sample of scan j
+        size_t step = std::max<size_t>(1, V_j.rows() / num_samples);
+        Eigen::MatrixXd V_sample(V_j.rows() / step, 3);
+        for (size_t s = 0; s < size_t(V_sample.rows()); s++){
+            V_sample.row(s) = V_j.row(s * step);
+        }
 
-    for (size_t i=0; i<V_matched.rows(); i++){
+        // Skip pairs that are too far apart to overlap
+        const Eigen::MatrixXd& V_i = target.GetVertices();
+        double near = 0.05 * (V_i.colwise().maxCoeff() - V_i.colwise().minCoeff()).norm();
+        if (ClassifyOverlap(target, V_sample, Eigen::MatrixXi(0, 3), near * near).ratio < min_overlap / 2){
+            return;
+        }
 
-        Eigen::Vector3d p_i = p_hat.row(i);
-        Eigen::Vector3d q_i = q_hat.row(i);
+        std::mt19937 generate(c);
+        Convergence convergence(criteria);
+        edge.transform = ICPAccumulated(target, V_j, subsample_rate, RejectionPolicy::Median(2.0), convergence, nullptr, &generate);
+        edge.iterations = convergence.Iterations();
+
+        // Vertices of the sample that lie on scan i once registered
+        Overlap overlap = ClassifyOverlap(target, ApplyRigidTransform(V_sample, edge.transform), Eigen::MatrixXi(0, 3), overlap_threshold);
+        edge.overlap = overlap.ratio;
+
+        size_t num_overlap = std::count(overlap.distant.begin(), overlap.distant.end(), 0);
+        size_t tie_step = std::max<size_t>(1, (num_overlap + max_tie_vertices - 1) / max_tie_vertices);
+        edge.V_j.resize((num_overlap + tie_step - 1) / tie_step, 3);
+        size_t num_tie = 0;
+        for (size_t s = 0, k = 0; s < overlap.distant.size(); s++){
+            if (overlap.distant[s]) continue;
+            if (k++ % tie_step == 0) edge.V_j.row(num_tie++) = V_sample.row(s);
+        }
+        edge.V_j.conservativeResize(num_tie, 3);
+    }, GetMinParallel(1));
 
-        A += q_i * p_i.transpose();
+    std::vector<PoseGraphEdge> edges;
+    for (size_t c = 0; c < candidates.size(); c++){
+        if (candidates[c].overlap >= min_overlap && candidates[c].V_j.rows() > 0){
+            edges.push_back(std::move(candidates[c]));
+        }
     }
 
-    Eigen::JacobiSVD<Eigen::MatrixXd> svd(A, Eigen::ComputeThinU | Eigen::ComputeThinV);
-    Eigen::MatrixXd R = svd.matrixV() * svd.matrixU().transpose();
-    Eigen::RowVector3d T = p_bar - (R * q_bar.transpose()).transpose();
+    return edges;
+}
 
-    transform.first = R;
-    transform.second = T;
+std::vector<std::pair<Eigen::Matrix3d, Eigen::RowVector3d>> ICP::OptimisePoseGraph(size_t num_scans, const std::vector<PoseGraphEdge>& edges, int max_iteration){
 
-    //
-    double error_metric = GetErrorMetric(V_matched, ApplyRigidTransform(V_to_process,transform));
+    // #Input: Pairwise transforms
+    // #Output: R, T of every scan (scan -> scan 0)
 
-    return std::pair<double, std::pair<Eigen::Matrix3d, Eigen::RowVector3d>> (error_metric, transform);
+    typedef std::pair<Eigen::Matrix3d, Eigen::RowVector3d> Pose;
+    std::vector<Pose> poses(num_scans, Pose(Eigen::Matrix3d::Identity(), Eigen::RowVector3d::Zero()));
 
-}
+    if (num_scans < 2){
+        return poses;
+    }
 
-std::pair<Eigen::Matrix3d, Eigen::RowVector3d> ICP::EstimateRigidTransformNormalBased(Eigen::MatrixXd V_matched, Eigen::MatrixXd V_to_process, Eigen::MatrixXd N_to_process){
+    // Unknowns are the (omega, t) steps of scans 1..n-1, applied on the left of each pose
+    const int num_unknowns = 6 * (num_scans - 1);
 
-    // #Input: V1_Matched, V2_Matched, N1_Matched
-    // #Output: R, T
+    for (int iteration = 0; iteration < max_iteration; iteration++){
 
-    // Reference slide: http://resources.mpi-inf.mpg.de/deformableShapeMatching/EG2011_Tutorial/slides/2.1%20Rigid%20ICP.pdf Page 12
+        Eigen::MatrixXd H = Eigen::MatrixXd::Zero(num_unknowns, num_unknowns);
+        Eigen::VectorXd g = Eigen::VectorXd::Zero(num_unknowns);
 
-    // Construct A and b to solve the point-to-plane error metric
-    // A = p_i x n_i, n_i
-    // b = -(p_i - q_i) . n_i
+        for (size_t e = 0; e < edges.size(); e++){
+            const PoseGraphEdge& edge = edges[e];
 
-    Eigen::MatrixXd A (V_matched.rows(), 6);
-    Eigen::MatrixXd b (V_matched.rows(), 1);
+            // Every edge weighs the same whatever its number of tie vertices
+            double w = 1.0 / edge.V_j.rows();
 
-    for (size_t i = 0; i < V_matched.rows(); i++){
+            for (size_t k = 0; k < size_t(edge.V_j.rows()); k++){
+                Eigen::RowVector3d x = edge.V_j.row(k);
+                Eigen::RowVector3d x_i = x * edge.transform.first.transpose() + edge.transform.second;
 
-        Eigen::RowVector3d N = N_to_process.row(i);
-        Eigen::RowVector3d S = V_to_process.row(i);
-        Eigen::RowVector3d D = V_matched.row(i);
+                // r = a - b, a = P_i x_i and b = P_j x; a small step moves a by omega x a + t
+                Eigen::Vector3d a = (x_i * poses[edge.i].first.transpose() + poses[edge.i].second).transpose();
+                Eigen::Vector3d b = (x * poses[edge.j].first.transpose() + poses[edge.j].second).transpose();
+                Eigen::Vector3d r = a - b;
 
-        A(i,0) = N.z()*D.y()-N.y()*D.z();
-        A(i,1) = N.x()*D.z()-N.z()*D.x();
-        A(i,2) = N.y()*D.x()-N.x()*D.y();
-        A(i,3) = N.x();
-        A(i,4) = N.y();
-        A(i,5) = N.z();
+                Eigen::Matrix<double, 3, 6> J_i, J_j;
+                J_i.leftCols<3>() << 0, a.z(), -a.y(), -a.z(), 0, a.x(), a.y(), -a.x(), 0;
+                J_i.rightCols<3>() = Eigen::Matrix3d::Identity();
+                J_j.leftCols<3>() << 0, -b.z(), b.y(), b.z(), 0, -b.x(), -b.y(), b.x(), 0;
+                J_j.rightCols<3>() = -Eigen::Matrix3d::Identity();
 
-        b(i) = N.x()*D.x() + N.y()*D.y() + N.z()*D.z() - N.x()*S.x() - N.y()*S.y() - N.z()*S.z();
-    }
+                // Scan 0 is fixed, it has no block
+                int block_i = int(edge.i) - 1;
+                int block_j = int(edge.j) - 1;
+                if (block_i >= 0){
+                    H.block<6, 6>(6 * block_i, 6 * block_i) += w * J_i.transpose() * J_i;
+                    g.segment<6>(6 * block_i) += w * J_i.transpose() * r;
+                }
+                if (block_j >= 0){
+                    H.block<6, 6>(6 * block_j, 6 * block_j) += w * J_j.transpose() * J_j;
+                    g.segment<6>(6 * block_j) += w * J_j.transpose() * r;
+                }
+                if (block_i >= 0 && block_j >= 0){
+                    H.block<6, 6>(6 * block_i, 6 * block_j) += w * J_i.transpose() * J_j;
+                    H.block<6, 6>(6 * block_j, 6 * block_i) += w * J_j.transpose() * J_i;
+                }
+            }
+        }
 
-    // Solve x
-    // x = (alpha beta gamma t_x t_y t_z)'T
-    Eigen::MatrixXd x = ((A.transpose() * A).inverse()) * (A.transpose()) * b;
+        // A scan without edges has an empty block, the damping keeps it at its pose
+        H.diagonal().array() += 1e-9;
+        Eigen::VectorXd x = H.ldlt().solve(-g);
 
-    // Compute rigid transform R and T
-    Eigen::Matrix3d R;
-    R.setZero();
+        for (size_t s = 1; s < num_scans; s++){
+            Eigen::Vector3d omega = x.segment<3>(6 * (s - 1));
+            Pose step(Eigen::Matrix3d::Identity(), x.segment<3>(6 * (s - 1) + 3).transpose());
+            if (omega.norm() > 0){
+                step.first = Eigen::AngleAxisd(omega.norm(), omega.normalized()).toRotationMatrix();
+            }
+            poses[s] = ComposeRigidTransform(poses[s], step);
+        }
 
-    double sin_alpha = sin(x(0));
-    double cos_alpha = cos(x(0));
-    double sin_beta = sin(x(1));
-    double cos_beta = cos(x(1));
-    double sin_gamma = sin(x(2));
-    double cos_gamma = cos(x(2));
-    R(0,0) = cos_gamma * cos_beta;
-    R(0,1) = -sin_gamma * cos_alpha + cos_gamma * sin_beta * sin_alpha;
-    R(0,2) = sin_gamma * sin_alpha + cos_gamma * sin_beta * cos_alpha;
-    R(1,0) = sin_gamma * cos_beta;
-    R(1,1) = cos_gamma * cos_alpha + sin_gamma * sin_beta * sin_alpha;
-    R(1,2) = -cos_gamma * sin_alpha + sin_gamma * sin_beta * cos_alpha;
-    R(2,0) = -sin_beta;
-    R(2,1) = cos_beta * sin_alpha;
-    R(2,2) = cos_beta * cos_alpha;
+        if (x.norm() < 1e-10){
+            break;
+        }
+    }
 
-    Eigen::RowVector3d T(x(3),x(4),x(5));
+    return poses;
+}
 
-    return std::pair<Eigen::Matrix3d, Eigen::RowVector3d>(R,T);
+std::vector<std::pair<Eigen::Matrix3d, Eigen::RowVector3d>> ICP::AlignMultiView(const std::vector<Target>& scans, const ConvergenceCriteria& criteria, double subsample_rate, double min_overlap, std::vector<PoseGraphEdge>* edges){
+    std::vector<PoseGraphEdge> found = FindPoseGraphEdges(scans, criteria, subsample_rate, min_overlap);
+    std::vector<std::pair<Eigen::Matrix3d, Eigen::RowVector3d>> poses = OptimisePoseGraph(scans.size(), found);
+    if (edges){
+        *edges = std::move(found);
+    }
+    return poses;
+}
 
+Eigen::MatrixXd ICP::ICPOptimised(const Eigen::Ref<const Eigen::MatrixXd>& V_target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, double subsample_rate){
+    return ICPOptimised(Target(V_target), V_to_process, subsample_rate);
 }
 
-Eigen::MatrixXd ICP::ApplyRigidTransform(Eigen::MatrixXd V_to_process, std::pair<Eigen::Matrix3d, Eigen::RowVector3d> transform){
+Eigen::MatrixXd ICP::ICPOptimised(const Target& target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, double subsample_rate, std::pair<double, std::pair<Eigen::Matrix3d, Eigen::RowVector3d>>* transform_info){
+    Eigen::MatrixXd V_subsampled = GetSubsample(V_to_process, subsample_rate);
+    PointToPointSums sums = AccumulateCorrespondences(target, V_subsampled, RejectionPolicy::Median(2.0));
+    std::pair<double, std::pair<Eigen::Matrix3d, Eigen::RowVector3d>> estimate = ICP::EstimateRigidTransform(sums);
+    if (transform_info){
+        *transform_info = estimate;
+    }
+    return ICP::ApplyRigidTransform(V_to_process, estimate.second);
+}
 
-    // #Input: V2, R, T
-    // #Output: V2_Transformed
+ICP::Convergence::Convergence(const ConvergenceCriteria& criteria):criteria(criteria){
+    start_time = std::chrono::steady_clock::now();
+    if (criteria.max_iteration <= 0){
+        reason = MAX_ITERATION;
+    }
+}
 
-    Eigen::MatrixXd V_out;
-    V_out.resize(V_to_process.rows(), V_to_process.cols());
-    V_out.setZero();
+bool ICP::Convergence::Update(double error, const std::pair<Eigen::Matrix3d, Eigen::RowVector3d>& step){
 
-    // According to the formula, p = Rq + t
-    for (size_t i=0;i<V_to_process.rows();i++){
-        Eigen::Vector3d row = V_to_process.row(i);
-        V_out.row(i) = (transform.first * row).transpose() + transform.second;
+    iterations++;
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+
+    if (reason != NOT_STOPPED){
+        return true;
     }
 
-    return V_out;
+    // Relative change of the RMS distance, the first iteration has nothing to compare with
+    if (error >= 0){
+        double rms = std::sqrt(error);
+        if (criteria.relative_rms_change > 0 && last_rms > 0 && std::abs(last_rms - rms) <= criteria.relative_rms_change * last_rms){
+            reason = RMS_CONVERGED;
+        }
+        last_rms = rms;
+    }
+
+    // The last step barely moved the scan
+    double delta = (step.first - Eigen::Matrix3d::Identity()).norm() + step.second.norm();
+    if (reason == NOT_STOPPED && criteria.transform_delta > 0 && delta <= criteria.transform_delta){
+        reason = TRANSFORM_CONVERGED;
+    }
+
+    if (reason == NOT_STOPPED && criteria.time_budget > 0 && seconds >= criteria.time_budget){
+        reason = TIME_BUDGET;
+    }
+
+    if (reason == NOT_STOPPED && iterations >= criteria.max_iteration){
+        reason = MAX_ITERATION;
+    }
+
+    return reason != NOT_STOPPED;
 }
 
-Eigen::MatrixXd ICP::ICPOptimised(Eigen::MatrixXd V_target, Eigen::MatrixXd V_to_process, double subsample_rate){
-    Eigen::MatrixXd V_subsampled = GetSubsample(V_to_process, subsample_rate);
-    std::pair<Eigen::MatrixXd, Eigen::MatrixXd> correspondences = FindCorrespondences(V_target, V_subsampled);
-    std::pair<double, std::pair<Eigen::Matrix3d, Eigen::RowVector3d>> transform_info = ICP::EstimateRigidTransform(correspondences.first, correspondences.second);
-    return ICP::ApplyRigidTransform(V_to_process, transform_info.second);
+bool ICP::Convergence::Stopped() const{
+    return reason != NOT_STOPPED;
+}
+
+ICP::Convergence::Reason ICP::Convergence::GetReason() const{
+    return reason;
 }
 
-//Eigen::MatrixXd ICP::ICPNormalBased(Eigen::MatrixXd V_target, Eigen::MatrixXd V_to_process){
-////    Eigen::MatrixXd N = GetVertexNormal(V_target);
-////    std::pair<std::pair<Eigen::MatrixXd, Eigen::MatrixXd>, Eigen::MatrixXd> correspondences = FindCorrespondencesNormalBased(V_target, V_to_process, N);
-////    std::pair<Eigen::Matrix3d, Eigen::RowVector3d> transform = ICP::EstimateRigidTransformNormalBased(correspondences.first.first, correspondences.second, correspondences.first.second);
-////    return ICP::ApplyRigidTransform(V_to_process, transform);
-////}
+int ICP::Convergence::Iterations() const{
+    return iterations;
+}
+
+double ICP::Convergence::Seconds() const{
+    return seconds;
+}
 
-double ICP::GetErrorMetric(Eigen::MatrixXd V_target, Eigen::MatrixXd V_to_process){
+double ICP::GetErrorMetric(const Eigen::Ref<const Eigen::MatrixXd>& V_target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process){
 
-    double error_metric = 0.0;
-    for (size_t i = 0; i < V_target.rows(); i++)
-    {
-        Eigen::RowVector3d V_i_target = V_target.row(i);
-        Eigen::RowVector3d V_i_to_process = V_to_process.row(i);
-        error_metric += (V_i_target - V_i_to_process).squaredNorm();
+    // Row i of one scan is matched to row i of the other, so both must have as many rows
+    if (V_target.rows() != V_to_process.rows() || V_target.cols() != V_to_process.cols()){
+        throw std::invalid_argument("ICP: the error metric needs matched scans of the same size");
     }
 
+    // Sum of every squared coordinate difference, column by column
+    double error_metric = (V_target - V_to_process).squaredNorm();
+
     // Return normalised error
     return error_metric/V_target.rows();
 
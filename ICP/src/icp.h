@@ -1,33 +1,443 @@
 // Global static functions
 
+#include <chrono>
+#include <limits>
+#include <memory>
+#include <random>
+#include <vector>
+
 namespace ICP{
 
-    Eigen::MatrixXd GetSubsample(Eigen::MatrixXd V_to_process, double subsample_rate);
+    // Registration target, owns a copy of the scan and the KD tree built over it
+    // The index is built once and shared by every query against the same scan
+    class Target{
+    public:
+        Target();
+        explicit Target(const Eigen::Ref<const Eigen::MatrixXd>& V_target);
+
+        // A copy shares the index of a scan set with SetVertices, a grown scan is indexed again for the copy
+        Target(const Target& other);
+        Target& operator=(const Target& other);
+        Target(Target&& other) = default;
+        Target& operator=(Target&& other) = default;
+
+        // Rebuild the KD tree only if the geometry differs from the indexed one
+        void SetVertices(const Eigen::Ref<const Eigen::MatrixXd>& V_target);
+
+        // Same for a meshed scan, the faces then give the normals
+        // Empty faces go back to fitted normals for a scan indexed with faces before
+        void SetVertices(const Eigen::Ref<const Eigen::MatrixXd>& V_target, const Eigen::Ref<const Eigen::MatrixXi>& F_target);
+
+        // Append vertices (e.g. a newly aligned scan) after the indexed ones, faces are dropped
+        // The points go into a dynamic tree, so merging n scans costs O(n log n) tree work instead of O(n^2)
+        // Each grown target owns its tree, a copy of it builds a tree of its own
+        void AddVertices(const Eigen::Ref<const Eigen::MatrixXd>& V_added);
+
+        const Eigen::MatrixXd& GetVertices() const;
+        size_t Size() const;
+
+        // Vertex normals of the scan (see GetVertexNormal), estimated once and reused until the geometry changes
+        // Taken from the faces if the target was given any, fitted to the nearest neighbours otherwise
+        const Eigen::MatrixXd& GetNormals() const;
+
+        // Vertex covariances of the scan (see GetVertexCovariance), cached the same way
+        const std::vector<Eigen::Matrix3d>& GetCovariances() const;
+
+        // Closest target vertex to the query, returns its index and the squared distance
+        size_t FindClosest(const double* query_vertex, double& dist_sqr) const;
+
+        // k closest target vertices to the query, returns the number of vertices found
+        // The first num_seeds entries of indexes/dists_sqr may hold known candidates (e.g. last iteration's matches),
+        // their distances then bound the search from the root instead of starting unbounded
+        size_t FindClosest(const double* query_vertex, size_t num_result, size_t* indexes, double* dists_sqr, size_t num_seeds = 0) const;
+
+    private:
+        // The index of a scan set with SetVertices is shared by the copies of the target and never modified
+        // A grown index belongs to this target alone, AddVertices hands its tree on to the index of the grown scan
+        struct Index;
+        std::shared_ptr<Index> index;
+    };
+
+    // Matches of the previous pass over the same source vertices, used to warm-start the next pass
+    // A vertex that moved less than its margin keeps its match, the others are searched from their previous bound
+    struct CorrespondenceCache{
+        Eigen::MatrixXd V_searched;         // Position of each source vertex when it was last searched
+        std::vector<size_t> closest;        // Closest target vertex found then
+        std::vector<size_t> second;         // Second closest target vertex found then
+        std::vector<double> margin;         // Half the gap between the two distances, negative if never searched
+        size_t num_searched = 0;            // Number of vertices searched in the last pass
+
+        // Must be called when the source or the target scan changes
+        void Reset();
+    };
+
+    // Correspondence pairs as rows of the source and target scans, nothing is copied out of either scan
+    struct Correspondences{
+        std::vector<size_t> source;         // Row in V_to_process
+        std::vector<size_t> target;         // Row in the target scan
+        std::vector<double> weights;        // Weight of each pair in the rigid estimate
+
+        size_t Size() const { return source.size(); }
+    };
+
+    // M-estimator used to weight the pairs that survive rejection (iteratively reweighted least squares)
+    // Residuals are the pair distances, scaled by k * sigma with sigma = 1.4826 * median distance of the kept pairs
+    struct RobustKernel{
+        enum Type{
+            KERNEL_NONE,        // Every pair weighs 1
+            KERNEL_HUBER,       // 1 up to k sigma, then k sigma / r
+            KERNEL_TUKEY,       // (1 - (r / k sigma)^2)^2 up to k sigma, then 0
+            KERNEL_CAUCHY       // 1 / (1 + (r / k sigma)^2)
+        };
+
+        Type type = KERNEL_NONE;
+        double k = 1.0;
+
+        // Default tuning constants give 95% efficiency on Gaussian residuals
+        static RobustKernel Huber(double k = 1.345);
+        static RobustKernel Tukey(double k = 4.685);
+        static RobustKernel Cauchy(double k = 2.385);
+
+        double GetWeight(double residual, double sigma) const;
+    };
+
+    // How pairs are rejected once the closest vertices are known
+    // Statistics are found by O(n) selection, distances are compared squared like the original k * median test
+    struct RejectionPolicy{
+        enum Type{
+            REJECT_NONE,        // Keep every pair (normal test only)
+            REJECT_MEDIAN,      // d^2 <= k * median(d^2)
+            REJECT_MAD,         // d <= median(d) + k * 1.4826 * MAD(d)
+            REJECT_PERCENTILE   // Closest fraction of the pairs
+        };
+
+        Type type = REJECT_MEDIAN;
+        double k = 2.0;
+        double percentile = 0.9;
+        double max_normal_angle = 180.0;    // Degrees between source and target normals, 180 turns the test off
+        RobustKernel kernel;                // Weights of the kept pairs
+
+        static RejectionPolicy Median(double k);
+        static RejectionPolicy MAD(double k);
+        static RejectionPolicy Percentile(double percentile);
+        static RejectionPolicy NormalCompatible(double max_normal_angle);
+
+        // No hard threshold, every pair is weighted by the kernel instead
+        static RejectionPolicy Robust(const RobustKernel& kernel);
+    };
+
+    // Apply the policy to the closest vertex search result, normals are only needed for the normal test
+    // Pairs given a zero weight by the kernel are dropped as well
+    // Throws std::invalid_argument if the policy has a normal test but either normal set is missing
+    Correspondences RejectCorrespondences(const std::vector<size_t>& indexes, const std::vector<double>& dists_sqr, const RejectionPolicy& policy, const Eigen::MatrixXd* N_to_process = nullptr, const Eigen::MatrixXd* N_target = nullptr);
+
+    // Closest target vertex for every row of V_to_process, the queries are split across all cores
+    // If a transform is given each row is moved by it as it is read, V_to_process itself is never transformed
+    void FindClosestVertices(const Target& target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, std::vector<size_t>& indexes, std::vector<double>& dists_sqr, const std::pair<Eigen::Matrix3d, Eigen::RowVector3d>* transform = nullptr);
+    void FindClosestVertices(const Target& target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, std::vector<size_t>& indexes, std::vector<double>& dists_sqr, CorrespondenceCache& cache, const std::pair<Eigen::Matrix3d, Eigen::RowVector3d>* transform = nullptr);
+
+    // Drops about subsample_rate percent of the rows at random
+    // Draws from generate if given, rand() otherwise, which tasks running side by side must not share
+    Eigen::MatrixXd GetSubsample(const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, double subsample_rate, std::mt19937* generate = nullptr);
+
+    // Centroid of the vertices falling into each cell of a voxel grid
+    // Throws std::invalid_argument if voxel_size is not positive or too small for int voxel coordinates
+    Eigen::MatrixXd GetVoxelSubsample(const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, double voxel_size);
+
+    // Coarse-to-fine copies of a target scan with one index per level
+    // Level 0 is the full scan, level k is voxel-subsampled with voxel_size * 2^k
+    class TargetPyramid{
+    public:
+        // Rebuild the levels only if the scan or the parameters changed
+        void SetVertices(const Eigen::Ref<const Eigen::MatrixXd>& V_target, size_t num_levels, double voxel_size);
+
+        int Levels() const;
+        const Target& GetLevel(int level) const;
+        double GetVoxelSize(int level) const;
+
+    private:
+        std::vector<Target> levels;
+        std::vector<double> voxel_sizes;
+    };
+
+    Eigen::MatrixXd GetVertexNormal(const Eigen::Ref<const Eigen::MatrixXd>& V_target);
+    Eigen::MatrixXd GetVertexNormal(const Target& target);
+
+    // Covariance of each vertex for Generalized-ICP, from the same 20 neighbours as the normals
+    // Only the orientation of the neighbourhood is kept: variance 1 along the surface and epsilon across it
+    std::vector<Eigen::Matrix3d> GetVertexCovariance(const Target& target, double epsilon = 1e-3);
+
+    // Area-weighted vertex normals of a meshed scan in one pass over the faces, oriented by the face winding
+    // Vertices used by no face get a zero normal
+    Eigen::MatrixXd GetVertexNormal(const Eigen::Ref<const Eigen::MatrixXd>& V_target, const Eigen::Ref<const Eigen::MatrixXi>& F_target);
+
+    std::pair<Eigen::MatrixXd, Eigen::MatrixXd> FindCorrespondences(const Eigen::Ref<const Eigen::MatrixXd>& V_target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process);
+    std::pair<Eigen::MatrixXd, Eigen::MatrixXd> FindCorrespondences(const Target& target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, CorrespondenceCache* cache = nullptr);
+
+    // N_to_process are the current normals of the source rows, tested against the target's normals
+    Correspondences FindCorrespondences(const Target& target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const RejectionPolicy& policy, CorrespondenceCache* cache = nullptr, const Eigen::MatrixXd* N_to_process = nullptr);
+
+    // Running sums of the point-to-point estimate over the kept pairs (p in the target, q in the source)
+    // Centroids, cross-covariance and residual all follow from these few scalars, no matched copies are needed
+    // Points are added relative to origin so the sums stay well conditioned for scans far from (0,0,0)
+    struct PointToPointSums{
+        Eigen::RowVector3d origin = Eigen::RowVector3d::Zero();
+        size_t count = 0;                                       // Number of pairs
+        double weight = 0;                                      // Sigma w_i
+        Eigen::RowVector3d sum_p = Eigen::RowVector3d::Zero();  // Sigma w_i * p_i
+        Eigen::RowVector3d sum_q = Eigen::RowVector3d::Zero();  // Sigma w_i * q_i
+        Eigen::Matrix3d sum_qp = Eigen::Matrix3d::Zero();       // Sigma w_i * q_i * p_i^T
+        double sum_pp = 0;                                      // Sigma w_i * ||p_i||^2
+        double sum_qq = 0;                                      // Sigma w_i * ||q_i||^2
+
+        void Add(const Eigen::RowVector3d& p, const Eigen::RowVector3d& q, double w = 1.0);
+
+        // Merge the sums over another set of pairs, both must share the same origin
+        void Add(const PointToPointSums& other);
+
+        // Sigma w_i * (q_i - q_bar) * (p_i - p_bar)^T
+        Eigen::Matrix3d GetCrossCovariance() const;
 
-    Eigen::MatrixXd GetVertexNormal(Eigen::MatrixXd V_target);
+        // Weighted mean squared distance of the pairs as they are, before any transform
+        double GetError() const;
+    };
 
-    std::pair<Eigen::MatrixXd, Eigen::MatrixXd> FindCorrespondences(Eigen::MatrixXd V_target, Eigen::MatrixXd V_to_process);
+    // Closest vertex search, rejection and accumulation of the kept pairs without building any matched matrix
+    // Only the distance and kernel parts of the policy apply, a normal test throws std::invalid_argument
+    // With a transform the source rows are moved as they are read
+    PointToPointSums AccumulateCorrespondences(const Target& target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const RejectionPolicy& policy, CorrespondenceCache* cache = nullptr, const std::pair<Eigen::Matrix3d, Eigen::RowVector3d>* transform = nullptr);
 
-    std::pair<double, std::pair<Eigen::Matrix3d, Eigen::RowVector3d>> EstimateRigidTransform(Eigen::MatrixXd V_matched, Eigen::MatrixXd V_to_process);
+    // Sums over the pairs (row i of target, row i of source) of two matched scans, every pair weighs 1
+    // The moments are column-wise products over the N x 3 matrices, nothing is copied
+    PointToPointSums GetPairSums(const Eigen::Ref<const Eigen::MatrixXd>& V_target, const Eigen::Ref<const Eigen::MatrixXd>& V_source);
 
-    std::pair<std::pair<Eigen::MatrixXd, Eigen::MatrixXd>, Eigen::MatrixXd> FindCorrespondencesNormalBased(Eigen::MatrixXd V_target, Eigen::MatrixXd V_to_process, Eigen::MatrixXd N_target);
+    std::pair<double, std::pair<Eigen::Matrix3d, Eigen::RowVector3d>> EstimateRigidTransform(const Eigen::Ref<const Eigen::MatrixXd>& V_matched, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process);
+    std::pair<double, std::pair<Eigen::Matrix3d, Eigen::RowVector3d>> EstimateRigidTransform(const Eigen::Ref<const Eigen::MatrixXd>& V_target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const Correspondences& correspondences);
 
-    std::pair<Eigen::Matrix3d, Eigen::RowVector3d> EstimateRigidTransformNormalBased(Eigen::MatrixXd V_matched, Eigen::MatrixXd V_to_process, Eigen::MatrixXd N_to_process);
+    // Same estimate from accumulated sums in constant time, with the error after the transform
+    std::pair<double, std::pair<Eigen::Matrix3d, Eigen::RowVector3d>> EstimateRigidTransform(const PointToPointSums& sums);
 
-    Eigen::MatrixXd ApplyRigidTransform(Eigen::MatrixXd V_to_process, std::pair<Eigen::Matrix3d, Eigen::RowVector3d> transform);
+    std::pair<std::pair<Eigen::MatrixXd, Eigen::MatrixXd>, Eigen::MatrixXd> FindCorrespondencesNormalBased(const Eigen::Ref<const Eigen::MatrixXd>& V_target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const Eigen::Ref<const Eigen::MatrixXd>& N_target);
+    std::pair<std::pair<Eigen::MatrixXd, Eigen::MatrixXd>, Eigen::MatrixXd> FindCorrespondencesNormalBased(const Target& target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const Eigen::Ref<const Eigen::MatrixXd>& N_target, CorrespondenceCache* cache = nullptr);
+
+    std::pair<Eigen::Matrix3d, Eigen::RowVector3d> EstimateRigidTransformNormalBased(const Eigen::Ref<const Eigen::MatrixXd>& V_matched, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const Eigen::Ref<const Eigen::MatrixXd>& N_to_process);
+    std::pair<Eigen::Matrix3d, Eigen::RowVector3d> EstimateRigidTransformNormalBased(const Eigen::Ref<const Eigen::MatrixXd>& V_target, const Eigen::Ref<const Eigen::MatrixXd>& N_target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const Correspondences& correspondences);
+
+    // Normal equations of the linearised point-to-plane system, x = (alpha beta gamma t_x t_y t_z)
+    // Each pair adds a_i = (p_i x n_i, n_i), b_i = n_i . (p_i - q_i), memory does not grow with the pairs
+    struct PointToPlaneSums{
+        size_t count = 0;                                                   // Number of pairs
+        double weight = 0;                                                  // Sigma w_i
+        Eigen::Matrix<double, 6, 6> AtA = Eigen::Matrix<double, 6, 6>::Zero(); // Sigma w_i * a_i^T * a_i
+        Eigen::Matrix<double, 6, 1> Atb = Eigen::Matrix<double, 6, 1>::Zero(); // Sigma w_i * a_i^T * b_i
+        double btb = 0;                                                     // Sigma w_i * b_i^2
+
+        // p on the target with normal n, q on the source
+        void Add(const Eigen::RowVector3d& p, const Eigen::RowVector3d& n, const Eigen::RowVector3d& q, double w = 1.0);
+
+        // Merge the sums over another set of pairs
+        void Add(const PointToPlaneSums& other);
+
+        // Weighted mean squared point-to-plane distance of the pairs as they are, before any transform
+        double GetError() const;
+    };
+
+    // Point-to-plane sums of the index pairs, each thread sums its own pairs
+    // If a transform is given each source vertex is moved by it as it is read
+    PointToPlaneSums GetPointToPlaneSums(const Eigen::Ref<const Eigen::MatrixXd>& V_target, const Eigen::Ref<const Eigen::MatrixXd>& N_target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const Correspondences& correspondences, const std::pair<Eigen::Matrix3d, Eigen::RowVector3d>* transform = nullptr);
+
+    // Same estimate from accumulated sums, solved with a fixed-size LDLT
+    std::pair<Eigen::Matrix3d, Eigen::RowVector3d> EstimateRigidTransformNormalBased(const PointToPlaneSums& sums);
+
+    // Gauss-Newton system of the Generalized-ICP objective around the current step, x = (omega, t)
+    struct GeneralisedSums{
+        size_t count = 0;                                                   // Number of pairs
+        double weight = 0;                                                  // Sigma w_i
+        Eigen::Matrix<double, 6, 6> H = Eigen::Matrix<double, 6, 6>::Zero();   // Sigma w_i * J_i^T M_i J_i
+        Eigen::Matrix<double, 6, 1> g = Eigen::Matrix<double, 6, 1>::Zero();   // Sigma w_i * J_i^T M_i r_i
+        double error = 0;                                                   // Sigma w_i * r_i^T M_i r_i
+
+        // residual = p - q for the moved source vertex q, M the inverse of the combined covariance of the pair
+        void Add(const Eigen::RowVector3d& residual, const Eigen::RowVector3d& q, const Eigen::Matrix3d& M, double w = 1.0);
+
+        // Merge the sums over another set of pairs
+        void Add(const GeneralisedSums& other);
+    };
+
+    // Generalized-ICP (plane-to-plane), min(R,t) Sigma_i d_i^T (C_p_i + R C_q_i R^T)^-1 d_i with d_i = p_i - R q_i - t
+    // C_to_process are the source covariances in its original pose, R_to_process the rotation applied since
+    // Up to max_step Gauss-Newton steps on SE(3), returns the error before the last step and the transform
+    std::pair<double, std::pair<Eigen::Matrix3d, Eigen::RowVector3d>> EstimateRigidTransformGeneralised(const Target& target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const std::vector<Eigen::Matrix3d>& C_to_process, const Eigen::Matrix3d& R_to_process, const Correspondences& correspondences, int max_step = 3);
+
+    Eigen::MatrixXd ApplyRigidTransform(const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const std::pair<Eigen::Matrix3d, Eigen::RowVector3d>& transform);
+
+    // Same into a caller-owned matrix that is only reallocated if its size differs, V_out must not be V_to_process
+    void ApplyRigidTransform(const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const std::pair<Eigen::Matrix3d, Eigen::RowVector3d>& transform, Eigen::MatrixXd& V_out);
+
+    // Single transform equivalent to applying first and then second
+    std::pair<Eigen::Matrix3d, Eigen::RowVector3d> ComposeRigidTransform(std::pair<Eigen::Matrix3d, Eigen::RowVector3d> first, std::pair<Eigen::Matrix3d, Eigen::RowVector3d> second);
     
-    std::pair<Eigen::MatrixXi, Eigen::MatrixXi> FindNonOverlappingFaces(Eigen::MatrixXd V_target, Eigen::MatrixXd V_to_process, Eigen::MatrixXi F_to_process);
+    // Split of a scan by whether it lies on the target, faces keep their order within each part
+    struct Overlap{
+        std::vector<char> distant;          // Per source vertex, 1 if its closest target vertex is beyond the threshold
+        Eigen::MatrixXi F_overlap;          // Faces with no distant vertex
+        Eigen::MatrixXi F_non_overlap;      // Faces with at least one distant vertex
+        double ratio = 0;                   // Fraction of the source vertices that overlap the target
+    };
+
+    // One parallel closest vertex pass, then one over the faces, outputs are allocated at their final size
+    // threshold is a squared distance, the default matches the "Show Non-Overlapping Area" view
+    Overlap ClassifyOverlap(const Target& target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const Eigen::Ref<const Eigen::MatrixXi>& F_to_process, double threshold = 0.00001);
 
-    Eigen::MatrixXd Rotate(Eigen::MatrixXd V_in, double x, double y, double z);
+    // Overlapping and non-overlapping faces (see ClassifyOverlap)
+    std::pair<Eigen::MatrixXi, Eigen::MatrixXi> FindNonOverlappingFaces(const Eigen::Ref<const Eigen::MatrixXd>& V_target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const Eigen::Ref<const Eigen::MatrixXi>& F_to_process);
+    std::pair<Eigen::MatrixXi, Eigen::MatrixXi> FindNonOverlappingFaces(const Target& target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const Eigen::Ref<const Eigen::MatrixXi>& F_to_process);
+
+    Eigen::MatrixXd Rotate(const Eigen::Ref<const Eigen::MatrixXd>& V_in, double x, double y, double z);
     
-    Eigen::MatrixXd AddNoise(Eigen::MatrixXd V_in, double sd);
+    Eigen::MatrixXd AddNoise(const Eigen::Ref<const Eigen::MatrixXd>& V_in, double sd);
+
+    // When an iterative alignment stops, a criterion set to 0 is not checked
+    struct ConvergenceCriteria{
+        int max_iteration = 300;
+        double relative_rms_change = 1e-4;  // |rms_prev - rms| / rms_prev between two iterations
+        double transform_delta = 1e-6;      // ||R - I|| + ||T|| of the last step, in scan units
+        double time_budget = 0;             // Wall-clock seconds for the whole run
+    };
+
+    // Follows one alignment run against the criteria and records what it used
+    // The clock starts on construction, the run loops while !Stopped() and reports every iteration to Update()
+    class Convergence{
+    public:
+        enum Reason{
+            NOT_STOPPED,
+            RMS_CONVERGED,
+            TRANSFORM_CONVERGED,
+            TIME_BUDGET,
+            MAX_ITERATION
+        };
+
+        explicit Convergence(const ConvergenceCriteria& criteria);
+
+        // error is the mean squared distance of the iteration (negative if unknown), step the transform it applied
+        // Returns true once the run should stop
+        bool Update(double error, const std::pair<Eigen::Matrix3d, Eigen::RowVector3d>& step);
+
+        bool Stopped() const;
+        Reason GetReason() const;
+        int Iterations() const;
+        double Seconds() const;
+
+    private:
+        ConvergenceCriteria criteria;
+        std::chrono::steady_clock::time_point start_time;
+        Reason reason = NOT_STOPPED;
+        int iterations = 0;
+        double seconds = 0;
+        double last_rms = -1;
+    };
+
+    // Anderson acceleration of the ICP fixed-point iteration, on the pose as (rotation vector, translation)
+    // The next pose extrapolates the last window residuals G(u) - u of the plain ICP step G. A pose whose
+    // energy comes out higher than the previous one is replaced by the plain pose and the history is dropped
+    class AndersonAcceleration{
+    public:
+        // A window of 0 turns the acceleration off, every pose is then the plain one
+        explicit AndersonAcceleration(int window = 0);
+
+        // energy at the pose returned last time, plain that pose followed by one ICP step
+        // Returns the pose to evaluate next
+        std::pair<Eigen::Matrix3d, Eigen::RowVector3d> Update(double energy, const std::pair<Eigen::Matrix3d, Eigen::RowVector3d>& current, const std::pair<Eigen::Matrix3d, Eigen::RowVector3d>& plain);
+
+        // Number of extrapolated poses that were rejected
+        int Rejections() const;
+
+    private:
+        typedef Eigen::Matrix<double, 6, 1> Vector6d;
+
+        int window;
+        std::vector<Vector6d> G, F;             // Last plain poses and residuals G(u) - u
+        std::pair<Eigen::Matrix3d, Eigen::RowVector3d> last_plain;
+        double last_energy = std::numeric_limits<double>::max();
+        bool accelerated = false;
+        int rejections = 0;
+    };
+
+    // Point-to-point ICP that only composes the pose, the source scan is never transformed
+    // Each pass moves the rows it reads (a random subsample if subsample_rate > 0) by the pose so far,
+    // the caller applies the returned pose to the full scan once
+    // Runs until convergence stops it, accelerated if anderson is given, subsampled from generate if given
+    std::pair<Eigen::Matrix3d, Eigen::RowVector3d> ICPAccumulated(const Target& target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, double subsample_rate, const RejectionPolicy& policy, Convergence& convergence, AndersonAcceleration* anderson = nullptr, std::mt19937* generate = nullptr);
+
+    // Outcome of one source of a batch registration
+    struct Registration{
+        std::pair<Eigen::Matrix3d, Eigen::RowVector3d> transform;  // Source -> target
+        double rms = 0;                                         // RMS distance of the pairs kept at the final pose
+        double inlier_ratio = 0;                                // Fraction of the source vertices kept in those pairs
+        int iterations = 0;
+        Convergence::Reason reason = Convergence::NOT_STOPPED;
+    };
+
+    // Registers every source onto the same target, one task per source if there are at least as many sources
+    // as cores, one source after the other with parallel passes otherwise. The sources have no normals, so a
+    // policy testing normals throws std::invalid_argument
+    std::vector<Registration> RegisterBatch(const Target& target, const std::vector<Eigen::MatrixXd>& sources, const ConvergenceCriteria& criteria, double subsample_rate, const RejectionPolicy& policy, bool point_to_plane = false);
+
+    // Pairwise registration of two scans of a multi-view set, an edge of the pose graph
+    struct PoseGraphEdge{
+        size_t i = 0, j = 0;                                    // Scan j registered onto scan i
+        std::pair<Eigen::Matrix3d, Eigen::RowVector3d> transform;  // j -> i
+        double overlap = 0;                                     // Fraction of the sampled scan j vertices lying on scan i
+        Eigen::MatrixXd V_j;                                    // Those overlapping vertices (frame of j), they tie the two poses
+        int iterations = 0;
+    };
+
+    // Pairwise ICP between the scans in parallel, the scans are indexed by the caller and roughly aligned
+    // A pair is registered if min_overlap / 2 of a sample of scan j lies within 5% of the size of scan i,
+    // and kept if min_overlap of it lies on scan i after ICP
+    std::vector<PoseGraphEdge> FindPoseGraphEdges(const std::vector<Target>& scans, const ConvergenceCriteria& criteria, double subsample_rate, double min_overlap);
+
+    // Poses (scan -> common frame) minimising sum ||P_i (T_ij x) - P_j x||^2 over the tie vertices x of every edge,
+    // by Gauss-Newton steps on SE(3). Scan 0 stays fixed, a scan without any edge keeps the identity
+    std::vector<std::pair<Eigen::Matrix3d, Eigen::RowVector3d>> OptimisePoseGraph(size_t num_scans, const std::vector<PoseGraphEdge>& edges, int max_iteration = 20);
+
+    // Both steps, the cost grows with the overlapping pairs and not with a merged cloud
+    std::vector<std::pair<Eigen::Matrix3d, Eigen::RowVector3d>> AlignMultiView(const std::vector<Target>& scans, const ConvergenceCriteria& criteria, double subsample_rate = 95, double min_overlap = 0.3, std::vector<PoseGraphEdge>* edges = nullptr);
+
+    Eigen::MatrixXd ICPOptimised(const Eigen::Ref<const Eigen::MatrixXd>& V_target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, double subsample_rate);
+
+    // One subsampled iteration, the error and the transform applied are written to transform_info if given
+    Eigen::MatrixXd ICPOptimised(const Target& target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, double subsample_rate, std::pair<double, std::pair<Eigen::Matrix3d, Eigen::RowVector3d>>* transform_info = nullptr);
+
+    // Point-to-point ICP from the coarsest level to the finest, each level hands its transform down to the next
+    // The time budget covers the whole pyramid, convergences gets the run of every level that ran, coarsest first
+    std::pair<Eigen::Matrix3d, Eigen::RowVector3d> ICPPyramid(const TargetPyramid& pyramid, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, const RejectionPolicy& policy, const ConvergenceCriteria& criteria, std::vector<Convergence>* convergences = nullptr);
+
+    // Global start pose for ICP: the 27 rotations by 0/120/240 degrees about each axis and the 4 principal axes
+    // alignments are scored on a subsample by the closest half of their pairs. Each round drops the worse half
+    // and doubles the sample, starting from sample_size vertices
+    std::pair<Eigen::Matrix3d, Eigen::RowVector3d> FindStartPose(const Target& target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process, size_t sample_size = 200);
+
+    // FPFH descriptors (3 x 11 bins) of a voxel-subsampled copy of a scan
+    // The keypoints are indexed, their normals and neighbourhoods come from that cached index
+    struct FeatureCloud{
+        Target keypoints;
+        Eigen::Matrix<float, Eigen::Dynamic, 33, Eigen::RowMajor> descriptors;
+    };
 
-    Eigen::MatrixXd ICPOptimised(Eigen::MatrixXd V_target, Eigen::MatrixXd V_to_process, double subsample_rate);
+    // Neighbourhoods are the keypoints within 5 voxels, normals are fitted to the 20 nearest keypoints
+    FeatureCloud GetFeatures(const Eigen::Ref<const Eigen::MatrixXd>& V, double voxel_size);
 
-    Eigen::MatrixXd ICPNormalBased(Eigen::MatrixXd V_target, Eigen::MatrixXd V_to_process);
+    // Coarse pose from descriptor matches, for scans in any relative pose
+    // RANSAC over 3-pair hypotheses with matching edge lengths, scored by the pairs within 1.5 voxels
+    // max_iteration bounds the hypotheses, the search stops once the best inlier ratio gives 99.9% confidence
+    std::pair<Eigen::Matrix3d, Eigen::RowVector3d> FindFeaturePose(const FeatureCloud& target, const FeatureCloud& source, double voxel_size, int max_iteration = 100000, size_t* num_inliers = nullptr);
 
-    Eigen::MatrixXd FindBestStartRotation(Eigen::MatrixXd V_target, Eigen::MatrixXd V_to_process);
+    // V_to_process moved by FindStartPose, only the winning pose is applied
+    Eigen::MatrixXd FindBestStartRotation(const Eigen::Ref<const Eigen::MatrixXd>& V_target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process);
+    Eigen::MatrixXd FindBestStartRotation(const Target& target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process);
 
-    double GetErrorMetric(Eigen::MatrixXd V_target, Eigen::MatrixXd V_to_process);
+    // Mean squared distance between matched rows, throws std::invalid_argument if the scans differ in size
+    double GetErrorMetric(const Eigen::Ref<const Eigen::MatrixXd>& V_target, const Eigen::Ref<const Eigen::MatrixXd>& V_to_process);
 }
 
@@ -0,0 +1,226 @@
+// Checks of the ICP library on the bun scans, the run fails if any check does
+
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+#include <igl/readOFF.h>
+#include "icp.h"
+
+#ifndef DATA_PATH
+#define DATA_PATH "../data/"
+#endif
+
+static int failures = 0;
+
+#define CHECK(condition) do{ \
+    if (!(condition)){ \
+        std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << std::endl; \
+        failures++; \
+    } \
+}while (0)
+
+typedef std::pair<Eigen::Matrix3d, Eigen::RowVector3d> Pose;
+
+// Largest distance between the rows of V_target and the rows of V_to_process moved by the transform
+static double GetPoseError(const Eigen::MatrixXd& V_target, const Eigen::MatrixXd& V_to_process, const Pose& transform){
+    return (ICP::ApplyRigidTransform(V_to_process, transform) - V_target).rowwise().norm().maxCoeff();
+}
+
+// V1 moved by a known rigid transform, every solver has to bring it back onto V1
+static Eigen::MatrixXd GetMovedScan(const Eigen::MatrixXd& V1){
+    Pose pose;
+    pose.first = (Eigen::AngleAxisd(0.08, Eigen::Vector3d::UnitZ()) * Eigen::AngleAxisd(-0.05, Eigen::Vector3d::UnitX())).toRotationMatrix();
+    pose.second = Eigen::RowVector3d(0.004, -0.003, 0.002);
+    return ICP::ApplyRigidTransform(V1, pose);
+}
+
+static ICP::ConvergenceCriteria GetCriteria(){
+    ICP::ConvergenceCriteria criteria;
+    criteria.max_iteration = 300;
+    criteria.relative_rms_change = 0;
+    criteria.transform_delta = 1e-9;
+    return criteria;
+}
+
+static void TestPointToPoint(const Eigen::MatrixXd& V1, const Eigen::MatrixXd& V2, double tolerance){
+    ICP::Target target(V1);
+    ICP::Convergence convergence(GetCriteria());
+    Pose transform = ICP::ICPAccumulated(target, V2, 0, ICP::RejectionPolicy::Median(2.0), convergence);
+    CHECK(GetPoseError(V1, V2, transform) < tolerance);
+}
+
+static void TestPyramid(const Eigen::MatrixXd& V1, const Eigen::MatrixXd& V2, double tolerance){
+    ICP::TargetPyramid pyramid;
+    pyramid.SetVertices(V1, 3, (V1.colwise().maxCoeff() - V1.colwise().minCoeff()).norm() / 500);
+    std::vector<ICP::Convergence> convergences;
+    Pose transform = ICP::ICPPyramid(pyramid, V2, ICP::RejectionPolicy::Median(2.0), GetCriteria(), &convergences);
+    CHECK(convergences.size() == 3);
+    CHECK(GetPoseError(V1, V2, transform) < tolerance);
+}
+
+static void TestPointToPlane(const Eigen::MatrixXd& V1, const Eigen::MatrixXd& V2, double tolerance){
+    ICP::Target target(V1);
+    std::vector<ICP::Registration> registrations = ICP::RegisterBatch(target, {V2}, GetCriteria(), 0, ICP::RejectionPolicy::Median(2.0), true);
+    CHECK(registrations.size() == 1);
+    CHECK(GetPoseError(V1, V2, registrations[0].transform) < tolerance);
+}
+
+static void TestGeneralised(const Eigen::MatrixXd& V1, const Eigen::MatrixXd& V2, double tolerance){
+    ICP::Target target(V1);
+    ICP::Target source(V2);
+    const std::vector<Eigen::Matrix3d>& C2 = source.GetCovariances();
+    ICP::RejectionPolicy policy = ICP::RejectionPolicy::Median(2.0);
+
+    Pose transform(Eigen::Matrix3d::Identity(), Eigen::RowVector3d::Zero());
+    Eigen::MatrixXd Vx = V2;
+    ICP::Convergence convergence(GetCriteria());
+    while (!convergence.Stopped()){
+        ICP::Correspondences correspondences = ICP::FindCorrespondences(target, Vx, policy);
+        std::pair<double, Pose> transform_info = ICP::EstimateRigidTransformGeneralised(target, Vx, C2, transform.first, correspondences);
+        transform = ICP::ComposeRigidTransform(transform, transform_info.second);
+        ICP::ApplyRigidTransform(V2, transform, Vx);
+        convergence.Update(transform_info.first, transform_info.second);
+    }
+    CHECK(GetPoseError(V1, V2, transform) < tolerance);
+}
+
+static void TestVoxelSubsample(){
+
+    // Voxels are counted from the lowest corner (0.1, 0.1, 0.1): the first two vertices share a voxel,
+    // the third lies in the next voxel along x and the last two voxels along y
+    Eigen::MatrixXd V(4, 3);
+    V << 0.1, 0.1, 0.1,
+         0.3, 0.3, 0.3,
+         1.5, 0.5, 0.5,
+         0.25, 2.5, 0.1;
+    Eigen::MatrixXd V_voxel = ICP::GetVoxelSubsample(V, 1.0);
+    CHECK(V_voxel.rows() == 3);
+
+    // The order of the voxels is not specified, they are sorted by x before the comparison
+    std::vector<Eigen::RowVector3d> centroids;
+    for (int i = 0; i < V_voxel.rows(); i++){
+        centroids.push_back(V_voxel.row(i));
+    }
+    std::sort(centroids.begin(), centroids.end(), [](const Eigen::RowVector3d& a, const Eigen::RowVector3d& b){ return a(0) < b(0); });
+    if (centroids.size() == 3){
+        CHECK((centroids[0] - Eigen::RowVector3d(0.2, 0.2, 0.2)).norm() < 1e-12);
+        CHECK((centroids[1] - Eigen::RowVector3d(0.25, 2.5, 0.1)).norm() < 1e-12);
+        CHECK((centroids[2] - Eigen::RowVector3d(1.5, 0.5, 0.5)).norm() < 1e-12);
+    }
+
+    CHECK(ICP::GetVoxelSubsample(Eigen::MatrixXd(0, 3), 1.0).rows() == 0);
+
+    // Sizes that do not give a usable grid
+    int num_thrown = 0;
+    for (double voxel_size : {0.0, -1.0, 1e-12}){
+        try{
+            ICP::GetVoxelSubsample(V * 1000, voxel_size);
+        }catch (const std::invalid_argument&){
+            num_thrown++;
+        }
+    }
+    CHECK(num_thrown == 3);
+}
+
+static void TestAddVertices(const Eigen::MatrixXd& V1, const Eigen::MatrixXd& V2){
+
+    // V1 indexed at once and the same rows added to a growing target in three parts
+    ICP::Target indexed(V1);
+    Eigen::Index third = V1.rows() / 3;
+    ICP::Target grown(V1.topRows(third));
+    grown.AddVertices(V1.middleRows(third, third));
+    grown.AddVertices(V1.bottomRows(V1.rows() - 2 * third));
+    CHECK(grown.Size() == indexed.Size());
+    CHECK(grown.GetVertices() == V1);
+
+    // A copy of a grown target has a tree of its own and must answer the same
+    ICP::Target copy = grown;
+
+    // The scan has duplicate vertices, so neighbours at the same distance may come in another order
+    // Each one found must lie at the distance returned for it, and the distances must match the fresh index
+    auto is_neighbour = [&](const Eigen::RowVector3d& query, size_t index, double dist_sqr, double expected_dist_sqr){
+        return std::abs(dist_sqr - expected_dist_sqr) <= 1e-9 * expected_dist_sqr
+            && std::abs((V1.row(index) - query).squaredNorm() - dist_sqr) <= 1e-9 * dist_sqr;
+    };
+
+    const size_t k = 5;
+    bool same_neighbours = true;
+    for (Eigen::Index i = 0; i < V2.rows(); i += 97){
+        Eigen::RowVector3d query = V2.row(i);
+        size_t expected[k], found[k], found_copy[k];
+        double expected_dist[k], found_dist[k], found_copy_dist[k];
+        size_t num_expected = indexed.FindClosest(query.data(), k, expected, expected_dist);
+        size_t num_found = grown.FindClosest(query.data(), k, found, found_dist);
+        size_t num_found_copy = copy.FindClosest(query.data(), k, found_copy, found_copy_dist);
+        same_neighbours = same_neighbours && num_found == num_expected && num_found_copy == num_expected;
+        for (size_t n = 0; n < std::min(num_expected, num_found) && n < num_found_copy; n++){
+            same_neighbours = same_neighbours && is_neighbour(query, found[n], found_dist[n], expected_dist[n])
+                && is_neighbour(query, found_copy[n], found_copy_dist[n], expected_dist[n]);
+        }
+    }
+    CHECK(same_neighbours);
+}
+
+static void TestRegisterBatch(const Eigen::MatrixXd& V1, const Eigen::MatrixXd& V2){
+    ICP::Target target(V1);
+    std::vector<Eigen::MatrixXd> sources = {V2, ICP::Rotate(V2, 2, -1, 3), V2.topRows(V2.rows() / 2)};
+    ICP::RejectionPolicy policy = ICP::RejectionPolicy::Median(2.0);
+
+    // A fixed number of iterations, the sums of a batch task and of a lone run may be added in another order
+    ICP::ConvergenceCriteria criteria;
+    criteria.max_iteration = 50;
+    criteria.relative_rms_change = 0;
+    criteria.transform_delta = 0;
+
+    // Without subsampling a batch source runs the same iterations as a registration of its own
+    std::vector<ICP::Registration> registrations = ICP::RegisterBatch(target, sources, criteria, 0, policy);
+    CHECK(registrations.size() == sources.size());
+    for (size_t s = 0; s < sources.size() && s < registrations.size(); s++){
+        ICP::Convergence convergence(criteria);
+        Pose transform = ICP::ICPAccumulated(target, sources[s], 0, policy, convergence);
+        CHECK(registrations[s].iterations == convergence.Iterations());
+        CHECK((registrations[s].transform.first - transform.first).norm() < 1e-9);
+        CHECK((registrations[s].transform.second - transform.second).norm() < 1e-9);
+    }
+
+    // The sources have no normals to test
+    bool thrown = false;
+    try{
+        ICP::RegisterBatch(target, sources, criteria, 0, ICP::RejectionPolicy::NormalCompatible(45.0), true);
+    }catch (const std::invalid_argument&){
+        thrown = true;
+    }
+    CHECK(thrown);
+}
+
+int main(){
+
+    Eigen::MatrixXd V1, V2;
+    Eigen::MatrixXi F1, F2;
+    if (!igl::readOFF(DATA_PATH "bun000.off", V1, F1) || !igl::readOFF(DATA_PATH "bun045.off", V2, F2)){
+        std::cerr << "Cannot read the scans in " DATA_PATH << std::endl;
+        return 1;
+    }
+
+    // 0.1% of the scan size
+    Eigen::MatrixXd V_moved = GetMovedScan(V1);
+    double tolerance = (V1.colwise().maxCoeff() - V1.colwise().minCoeff()).norm() / 1000;
+
+    TestPointToPoint(V1, V_moved, tolerance);
+    TestPyramid(V1, V_moved, tolerance);
+    TestPointToPlane(V1, V_moved, tolerance);
+    TestGeneralised(V1, V_moved, tolerance);
+    TestVoxelSubsample();
+    TestAddVertices(V1, V2);
+    TestRegisterBatch(V1, V2);
+
+    if (failures > 0){
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All checks passed" << std::endl;
+    return 0;
+}
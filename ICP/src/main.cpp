@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include "icp.h"
 #include "scene.h"
 
 int main(int argc, char *argv[]){
@@ -27,9 +28,17 @@ int main(int argc, char *argv[]){
     double rotation_z = 0.0;
     double gaussian_sd = 0.0;
     int iteration = 300;
+    double tolerance = 0.0001;
+    double time_budget = 0.0;
+    int robust_kernel = 0;
+    int rejection = 0;
+    double max_normal_angle = 180.0;
+    int anderson_window = 0;
+    int start_pose = 0;
     double subsample_rate = 0.0;
     int frame = 1;
     bool mark_out = false;
+    bool face_normals = true;
 
     // Draw an optional panel for adjusting global variables
     menu.callback_draw_viewer_menu = [&]()
@@ -50,6 +59,46 @@ int main(int argc, char *argv[]){
                 scene.SetIteration(iteration);
             }
 
+            if(ImGui::InputDouble("Tolerance (RMS)", &tolerance, 0, 0, "%.6f"))
+            {
+                scene.SetTolerance(tolerance);
+            }
+
+            if(ImGui::InputDouble("Time Budget (s)", &time_budget, 0, 0, "%.2f"))
+            {
+                scene.SetTimeBudget(time_budget);
+            }
+
+            if (ImGui::Combo("Robust Kernel", &robust_kernel, "None\0Huber\0Tukey\0Cauchy\0\0"))
+            {
+                scene.SetRobustKernel(robust_kernel);
+            }
+
+            if (ImGui::Combo("Pair Rejection", &rejection, "k * Median\0MAD\0Percentile (90%)\0\0"))
+            {
+                scene.SetRejection(rejection);
+            }
+
+            if(ImGui::InputDouble("Max Normal Angle", &max_normal_angle, 0, 0, "%.1f"))
+            {
+                scene.SetMaxNormalAngle(max_normal_angle);
+            }
+
+            if(ImGui::InputInt("Anderson Window", &anderson_window))
+            {
+                scene.SetAndersonWindow(anderson_window);
+            }
+
+            if (ImGui::Combo("Start Pose", &start_pose, "None\0Rotation Search\0Features (FPFH)\0\0"))
+            {
+                scene.SetStartPose(start_pose);
+            }
+
+            if (ImGui::Checkbox("Normals From Faces", &face_normals))
+            {
+                scene.SetFaceNormals(face_normals);
+            }
+
             if (ImGui::Checkbox("Show Non-Overlapping Area", &mark_out))
             {
 
@@ -118,6 +167,10 @@ int main(int argc, char *argv[]){
             if (ImGui::Button("Align Meshes (Optimised)", ImVec2(-1, 0))){
                 scene.Point2PointAlignOptimised();
             }
+
+            if (ImGui::Button("Align Meshes (Pyramid)", ImVec2(-1, 0))){
+                scene.Point2PointAlignPyramid();
+            }
         }
         
         if (ImGui::CollapsingHeader("Task 5", ImGuiTreeNodeFlags_DefaultOpen))
@@ -136,6 +189,10 @@ int main(int argc, char *argv[]){
             if (ImGui::Button("Align Meshes (Normal-Based)", ImVec2(-1, 0))){
                 scene.Point2PlaneAlign();
             }
+
+            if (ImGui::Button("Align Meshes (Generalised)", ImVec2(-1, 0))){
+                scene.GeneralisedAlign();
+            }
         }
         
         ImGui::End();
@@ -385,6 +385,39 @@ namespace nanoflann
 		}
 	};
 
+	/** Squared Euclidean (L2) distance functor specialised at compile time for 3D point clouds.
+	  *  The three components are unrolled and read from one packed xyz triple, so each evaluation is straight-line code
+	  *  with no loop and no per-component accessor call.
+	  *  Corresponding distance traits: nanoflann::metric_L2_3D
+	  *  The DataSource must provide kdtree_get_pt_ptr(idx), returning a pointer to the three packed coordinates of the point idx.
+	  * \tparam T Type of the elements (e.g. double, float)
+	  * \tparam _DistanceType Type of distance variables (must be signed) (e.g. float, double)
+	  */
+	template<class T, class DataSource, typename _DistanceType = T>
+	struct L2_3D_Adaptor
+	{
+		typedef T ElementType;
+		typedef _DistanceType DistanceType;
+
+		const DataSource &data_source;
+
+		L2_3D_Adaptor(const DataSource &_data_source) : data_source(_data_source) { }
+
+		inline DistanceType evalMetric(const T* a, const size_t b_idx, size_t /* size */) const {
+			const T* b = data_source.kdtree_get_pt_ptr(b_idx);
+			const DistanceType diff0 = a[0] - b[0];
+			const DistanceType diff1 = a[1] - b[1];
+			const DistanceType diff2 = a[2] - b[2];
+			return diff0 * diff0 + diff1 * diff1 + diff2 * diff2;
+		}
+
+		template <typename U, typename V>
+		inline DistanceType accum_dist(const U a, const V b, int ) const
+		{
+			return (a - b) * (a - b);
+		}
+	};
+
 	/** SO2 distance functor
 	  *  Corresponding distance traits: nanoflann::metric_SO2
 	  * \tparam T Type of the elements (e.g. double, float)
@@ -468,6 +501,14 @@ namespace nanoflann
 			typedef L2_Simple_Adaptor<T, DataSource> distance_t;
 		};
 	};
+	/** Metaprogramming helper traits class for the compile-time 3D L2 metric */
+	struct metric_L2_3D : public Metric
+	{
+		template<class T, class DataSource>
+		struct traits {
+			typedef L2_3D_Adaptor<T, DataSource> distance_t;
+		};
+	};
 	/** Metaprogramming helper traits class for the SO3_InnerProdQuat metric */
 	struct metric_SO2 : public Metric 
 	{
@@ -1516,11 +1557,18 @@ namespace nanoflann
 			BaseClassRef::dim = dimensionality;
 			if (DIM>0) BaseClassRef::dim = DIM;
 			BaseClassRef::m_leaf_max_size = params.leaf_max_size;
+			// The empty trees are copied into place by the dynamic adaptor, give them a defined bounding box
+			for (size_t i = 0; i < BaseClassRef::root_bbox.size(); ++i) {
+				BaseClassRef::root_bbox[i].low = BaseClassRef::root_bbox[i].high = 0;
+			}
 		}
 
 
+		/** Copy constructor, declared since the assignment operator is user-defined (the implicit one is deprecated) */
+		KDTreeSingleIndexDynamicAdaptor_(const KDTreeSingleIndexDynamicAdaptor_& rhs) = default;
+
 		/** Assignment operator definiton */
-		KDTreeSingleIndexDynamicAdaptor_ operator=( const KDTreeSingleIndexDynamicAdaptor_& rhs ) {
+		KDTreeSingleIndexDynamicAdaptor_& operator=( const KDTreeSingleIndexDynamicAdaptor_& rhs ) {
 		      KDTreeSingleIndexDynamicAdaptor_ tmp( rhs );
 		      std::swap( BaseClassRef::vind, tmp.BaseClassRef::vind );
 		      std::swap( BaseClassRef::m_leaf_max_size, tmp.BaseClassRef::m_leaf_max_size );
@@ -1832,14 +1880,16 @@ namespace nanoflann
 		}
 
 
-		/** Add points to the set, Inserts all points from [start, end] */
+		/** Add points to the set, Inserts all points from [start, end]
+		  * The points are first distributed over the trees, each tree that changed is then built once for the whole range */
 		void addPoints(IndexType start, IndexType end)
 		{
 			int count = end - start + 1;
+			int maxIndex = 0;
 			treeIndex.resize(treeIndex.size() + count);
 			for(IndexType idx = start; idx <= end; idx++) {
 				int pos = First0Bit(pointCount);
-				index[pos].vind.clear();
+				maxIndex = std::max(pos, maxIndex);
 				treeIndex[pointCount]=pos;
 				for(int i = 0; i < pos; i++) {
 					for(int j = 0; j < static_cast<int>(index[i].vind.size()); j++) {
@@ -1847,12 +1897,13 @@ namespace nanoflann
 						treeIndex[index[i].vind[j]] = pos;
 					}
 					index[i].vind.clear();
-					index[i].freeIndex(index[i]);
 				}
 				index[pos].vind.push_back(idx);
-				index[pos].buildIndex();
 				pointCount++;
 			}
+			for(int i = 0; i <= maxIndex; i++) {
+				index[i].buildIndex();
+			}
 		}
 
 		/** Remove a point from the set (Lazy Deletion) */
@@ -1979,6 +2030,90 @@ namespace nanoflann
 	}; // end of KDTreeEigenMatrixAdaptor
 	/** @} */
 
+	/** A single-precision KD-tree adaptor for 3D point clouds, with the dimensionality fixed at compile time.
+	  *  Unlike KDTreeEigenMatrixAdaptor it keeps its own packed float copy of the points (x0 y0 z0 x1 y1 z1 ...), which takes half
+	  *  the memory of a double matrix, keeps the three coordinates of a point next to each other and lets L2_3D_Adaptor evaluate
+	  *  distances without any loop. Any matrix-like type with rows() and coeff(row, col) can be used as input, each row being a point.
+	  *
+	  *  Example of usage:
+	  * \code
+	  * 	Eigen::MatrixXd V;  // N x 3
+	  * 	// Fill out "V"...
+	  *
+	  * 	const int max_leaf = 10;
+	  * 	nanoflann::KDTreePointCloud3fAdaptor  cloud_index(V, max_leaf );
+	  * 	const float query[3] = { x, y, z };
+	  * 	cloud_index.index->findNeighbors(result, query, nanoflann::SearchParams());
+	  * \endcode
+	  */
+	struct KDTreePointCloud3fAdaptor
+	{
+		typedef KDTreePointCloud3fAdaptor self_t;
+		typedef float num_t;
+		typedef size_t IndexType;
+		typedef L2_3D_Adaptor<num_t,self_t> metric_t;
+		typedef KDTreeSingleIndexAdaptor< metric_t,self_t,3,IndexType>  index_t;
+
+		index_t* index; //! The kd-tree index for the user to call its methods as usual with any other FLANN index.
+
+		/// Constructor: copies the first three columns of the matrix to the packed float storage and builds the index
+		template <class MatrixType>
+		KDTreePointCloud3fAdaptor(const MatrixType &mat, const int leaf_max_size = 10) : m_points(3 * static_cast<size_t>(mat.rows()))
+		{
+			for (size_t i = 0; i < static_cast<size_t>(mat.rows()); i++) {
+				m_points[3 * i + 0] = static_cast<num_t>(mat.coeff(i, 0));
+				m_points[3 * i + 1] = static_cast<num_t>(mat.coeff(i, 1));
+				m_points[3 * i + 2] = static_cast<num_t>(mat.coeff(i, 2));
+			}
+			index = new index_t( 3, *this /* adaptor */, nanoflann::KDTreeSingleIndexAdaptorParams(leaf_max_size ) );
+			index->buildIndex();
+		}
+	private:
+		/** Hidden copy constructor, to disallow copying this class (Not implemented) */
+		KDTreePointCloud3fAdaptor(const self_t&);
+	public:
+
+		~KDTreePointCloud3fAdaptor() {
+			delete index;
+		}
+
+		std::vector<num_t> m_points;
+
+		/** @name Interface expected by KDTreeSingleIndexAdaptor and L2_3D_Adaptor
+		  * @{ */
+
+		const self_t & derived() const {
+			return *this;
+		}
+		self_t & derived()       {
+			return *this;
+		}
+
+		// Must return the number of data points
+		inline size_t kdtree_get_point_count() const {
+			return m_points.size() / 3;
+		}
+
+		// Returns the dim'th component of the idx'th point in the class:
+		inline num_t kdtree_get_pt(const IndexType idx, int dim) const {
+			return m_points[3 * idx + dim];
+		}
+
+		// Returns the packed xyz of the idx'th point, used by L2_3D_Adaptor
+		inline const num_t* kdtree_get_pt_ptr(const IndexType idx) const {
+			return &m_points[3 * idx];
+		}
+
+		// Optional bounding-box computation: return false to default to a standard bbox computation loop.
+		template <class BBOX>
+		bool kdtree_get_bbox(BBOX& /*bb*/) const {
+			return false;
+		}
+
+		/** @} */
+
+	}; // end of KDTreePointCloud3fAdaptor
+
 /** @} */ // end of grouping
 } // end of NS
 
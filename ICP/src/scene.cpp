@@ -1,7 +1,8 @@
+#include <chrono>
 #include <igl/readOFF.h>
 #include <igl/opengl/glfw/Viewer.h>
-#include "scene.h"
 #include "icp.h"
+#include "scene.h"
 
 #define FILE_PATH "../data/"
 
@@ -13,12 +14,33 @@ struct Scene::RenderingData{
 
 Scene::Scene(igl::opengl::glfw::Viewer& refViewer):viewer(refViewer){
     iteration = 300;
+    convergence_criteria.max_iteration = iteration;
+    anderson_window = 0;
+    rejection = ICP::RejectionPolicy::REJECT_MEDIAN;
+    max_normal_angle = 180.0;
+    start_pose = START_NONE;
     subsample_rate = 0;
     mark_out = false;
+    face_normals = true;
 }
 
 Scene::~Scene(){}
 
+// Why a run stopped, appended to the timing line
+static std::string GetStopReason(const ICP::Convergence& convergence){
+    switch (convergence.GetReason()){
+        case ICP::Convergence::RMS_CONVERGED: return " (RMS converged)";
+        case ICP::Convergence::TRANSFORM_CONVERGED: return " (transform converged)";
+        case ICP::Convergence::TIME_BUDGET: return " (time budget)";
+        default: return "";
+    }
+}
+
+// The feature matches a start pose was found from, appended to the timing line
+static std::string GetFeatureSummary(size_t num_matches){
+    return num_matches > 0 ? ", start pose from " + std::to_string(num_matches) + " feature match(es)" : "";
+}
+
 void Scene::Initialise(){
     
     rendering_data.clear();
@@ -45,30 +67,28 @@ void Scene::Point2PointAlign(){
     
     rendering_data.clear();
 
-    Eigen::MatrixXd Vx = V2;
+    // Times the run in wall-clock time, clock() would add up the CPU time of every correspondence thread
+    ICP::Convergence convergence(convergence_criteria);
 
-    int total_iteration = iteration;
+    // Index V1 once (or reuse the index from the previous run)
+    target.SetVertices(V1);
 
-    clock_t start_time = std::clock();
+    // Anderson acceleration may replace each plain ICP pose by an extrapolated one
+    ICP::AndersonAcceleration anderson(anderson_window);
 
-    double error_metric = 1000;
-
-    for (size_t i=0; i<iteration;i++){
-        // Basic ICP algorithm
-        std::pair<Eigen::MatrixXd, Eigen::MatrixXd> correspondences = ICP::FindCorrespondences(V1, Vx);
-        std::pair<double, std::pair<Eigen::Matrix3d, Eigen::RowVector3d>> transform_info = ICP::EstimateRigidTransform(correspondences.first, correspondences.second);
-        Vx = ICP::ApplyRigidTransform(Vx, transform_info.second);
-
-//        if (transform_info.first < error_metric){
-//            error_metric = transform_info.first;
-//        }else{
-//            total_iteration = i;
-//            break;
-//        }
+    // Optionally start from the best global pose instead of where V2 lies
+    Eigen::MatrixXd V_start;
+    size_t num_matches = 0;
+    if (start_pose != START_NONE){
+        V_start = MoveToStartPose(target, V2, &num_matches);
     }
+    const Eigen::MatrixXd& V_source = start_pose != START_NONE ? V_start : V2;
+
+    // Basic ICP algorithm on the full scan, V2 is only moved once the pose is final
+    std::pair<Eigen::Matrix3d, Eigen::RowVector3d> transform = ICP::ICPAccumulated(target, V_source, 0, GetRejectionPolicy(2.0), convergence, &anderson);
+    Eigen::MatrixXd Vx = ICP::ApplyRigidTransform(V_source, transform);
 
-    double time_taken = (clock() - start_time) / (double) CLOCKS_PER_SEC;
-    std::cout << "ICP Basic takes " + std::to_string(time_taken) + "s to complete " + std::to_string(total_iteration) + " iteration(s)" << std::endl;
+    std::cout << "ICP Basic takes " + std::to_string(convergence.Seconds()) + "s to complete " + std::to_string(convergence.Iterations()) + " iteration(s)" + GetStopReason(convergence) + GetFeatureSummary(num_matches) << std::endl;
 
     // Generate data and store them for display
     Eigen::MatrixXd V(V1.rows()+Vx.rows(), V1.cols());
@@ -86,10 +106,13 @@ void Scene::Point2PointAlign(){
 
     // Find non-overlapping area
     // Vx to V1
-    std::pair<Eigen::MatrixXi, Eigen::MatrixXi> FF2 = ICP::FindNonOverlappingFaces(V1, Vx, F2);
+    ICP::Overlap overlap = ICP::ClassifyOverlap(target, Vx, F2);
+    std::pair<Eigen::MatrixXi, Eigen::MatrixXi> FF2(std::move(overlap.F_overlap), std::move(overlap.F_non_overlap));
     // V1 to Vx
     std::pair<Eigen::MatrixXi, Eigen::MatrixXi> FF1 = ICP::FindNonOverlappingFaces(Vx, V1, F1);
 
+    std::cout << "  Overlap: " + std::to_string(overlap.ratio * 100) + "% of M2" << std::endl;
+
     Eigen::MatrixXd VM(V1.rows() + V1.rows() + Vx.rows() + Vx.rows(), V1.cols());
     VM << V1, V1, Vx, Vx;
 
@@ -177,30 +200,63 @@ void Scene::Point2PointAlignOptimised(){
 
     rendering_data.clear();
 
-    Eigen::MatrixXd Vx = V2;
+    ICP::Convergence convergence(convergence_criteria);
 
-    double last_distance = ICP::GetErrorMetric(V1, Vx);
-    int total_iteration = iteration;
-    double error_metric = 1000;
+    target.SetVertices(V1);
 
-    clock_t start_time = std::clock();
+    ICP::AndersonAcceleration anderson(anderson_window);
 
-    // Use the subsample to perform ICP algorithm
-    for (size_t i=0; i<iteration;i++){
-        Eigen::MatrixXd V_subsampled = ICP::GetSubsample(Vx, subsample_rate);
-        std::pair<Eigen::MatrixXd, Eigen::MatrixXd> correspondences = ICP::FindCorrespondences(V1, V_subsampled);
-        std::pair<double, std::pair<Eigen::Matrix3d, Eigen::RowVector3d>> transform_info = ICP::EstimateRigidTransform(correspondences.first, correspondences.second);
-        Vx =  ICP::ApplyRigidTransform(Vx, transform_info.second);
-//        if (transform_info.first < error_metric){
-//            error_metric = transform_info.first;
-//        }else{
-//            total_iteration = i;
-//            break;
-//        }
+    Eigen::MatrixXd V_start;
+    size_t num_matches = 0;
+    if (start_pose != START_NONE){
+        V_start = MoveToStartPose(target, V2, &num_matches);
     }
+    const Eigen::MatrixXd& V_source = start_pose != START_NONE ? V_start : V2;
+
+    // Use the subsample to perform ICP algorithm, only the subsample is moved on each iteration
+    std::pair<Eigen::Matrix3d, Eigen::RowVector3d> transform = ICP::ICPAccumulated(target, V_source, subsample_rate, GetRejectionPolicy(2.0), convergence, &anderson);
+    Eigen::MatrixXd Vx = ICP::ApplyRigidTransform(V_source, transform);
+
+    std::cout << "ICP Optimised takes " + std::to_string(convergence.Seconds()) + "s to complete " + std::to_string(convergence.Iterations()) + " iteration(s)" + GetStopReason(convergence) + GetFeatureSummary(num_matches) << std::endl;
+
+    // Generate data and store them for display
+    Eigen::MatrixXd V(V1.rows()+Vx.rows(), V1.cols());
+    V << V1,Vx;
+    Eigen::MatrixXi F(F1.rows()+F2.rows(),F1.cols());
+    F << F1,(F2.array()+V1.rows());
+    Eigen::MatrixXd C(F.rows(),3);
+    C <<
+      Eigen::RowVector3d(1.0,0.5,0.25).replicate(F1.rows(),1),
+      Eigen::RowVector3d(1.0,0.8,0.0).replicate(F2.rows(),1);
+
+    rendering_data.push_back(RenderingData{V,F,C});
+
+    Visualise(rendering_data.size());
+}
+
+void Scene::Point2PointAlignPyramid(){
 
-    double time_taken = (clock() - start_time) / (double) CLOCKS_PER_SEC;
-    std::cout << "ICP Optimised takes " + std::to_string(time_taken) + "s to complete " + std::to_string(total_iteration) + " iteration(s)" << std::endl;
+    rendering_data.clear();
+
+    const int num_levels = 4;
+
+    auto start_time = std::chrono::steady_clock::now();
+
+    // Spacing of the full scan relative to its size, level 1 doubles it (about 20k vertices for a bun scan)
+    double voxel_size = (V1.colwise().maxCoeff() - V1.colwise().minCoeff()).norm() / 500;
+    target_pyramid.SetVertices(V1, num_levels, voxel_size);
+
+    // The criteria apply to every level, the time budget to the whole pyramid
+    std::vector<ICP::Convergence> level_convergence;
+    std::pair<Eigen::Matrix3d, Eigen::RowVector3d> transform = ICP::ICPPyramid(target_pyramid, V2, GetRejectionPolicy(2.0), convergence_criteria, &level_convergence);
+    Eigen::MatrixXd Vx = ICP::ApplyRigidTransform(V2, transform);
+
+    double time_taken = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    std::cout << "ICP Pyramid takes " + std::to_string(time_taken) + "s to complete" + (level_convergence.size() < size_t(num_levels) ? " (time budget)" : "") << std::endl;
+    for (size_t i = 0; i < level_convergence.size(); i++){
+        int level = num_levels - 1 - i;
+        std::cout << "  Level " + std::to_string(level) + " (" + std::to_string(target_pyramid.GetLevel(level).Size()) + " vertices): " + std::to_string(level_convergence[i].Iterations()) + " iteration(s)" + GetStopReason(level_convergence[i]) << std::endl;
+    }
 
     // Generate data and store them for display
     Eigen::MatrixXd V(V1.rows()+Vx.rows(), V1.cols());
@@ -273,7 +329,7 @@ void Scene::MultiMeshAlign(){
 //    Eigen::MatrixXd V6r = V6;
 //    Eigen::MatrixXi F6r = F6;
 
-    clock_t start_time = std::clock();
+    auto start_time = std::chrono::steady_clock::now();
 
 //    for (size_t i=0; i<iteration;i++){
 //
@@ -347,45 +403,64 @@ void Scene::MultiMeshAlign(){
 //
 //    }
 
-    //V2r = ICP::FindBestStartRotation(V1, V2r);
-    for (size_t i=0; i<iteration;i++) {
-        V2r = ICP::ICPOptimised(V1, V2r, 95);
+    // A selected start pose moves each scan onto the scans placed before it
+    size_t num_matches = 0;
+    if (start_pose == START_ROTATION){
+
+        // The rotation search queries the placed scans, each one is inserted into one growing index
+        // instead of indexing V12, V123, V1234 again
+        ICP::Target merged(V1r);
+        V2r = MoveToStartPose(merged, V2r);
+        merged.AddVertices(V2r);
+        V3r = MoveToStartPose(merged, V3r);
+        merged.AddVertices(V3r);
+        V4r = MoveToStartPose(merged, V4r);
+        merged.AddVertices(V4r);
+        V5r = MoveToStartPose(merged, V5r);
+    }else if (start_pose == START_FEATURES){
+
+        // The features only read the vertices of the placed scans, they are concatenated without an index
+        size_t num_scan_matches[4];
+        V2r = MoveToFeaturePose(V1r, V2r, &num_scan_matches[0]);
+        Eigen::MatrixXd V12(V1r.rows()+V2r.rows(), V1r.cols());
+        V12 << V1r, V2r;
+        V3r = MoveToFeaturePose(V12, V3r, &num_scan_matches[1]);
+        Eigen::MatrixXd V123(V12.rows()+V3r.rows(), V12.cols());
+        V123 << V12, V3r;
+        V4r = MoveToFeaturePose(V123, V4r, &num_scan_matches[2]);
+        Eigen::MatrixXd V1234(V123.rows()+V4r.rows(), V123.cols());
+        V1234 << V123, V4r;
+        V5r = MoveToFeaturePose(V1234, V5r, &num_scan_matches[3]);
+        num_matches = num_scan_matches[0] + num_scan_matches[1] + num_scan_matches[2] + num_scan_matches[3];
     }
 
-    Eigen::MatrixXd V12(V1.rows()+V2r.rows(), V1.cols());
-    V12<<V1, V2r;
-    Eigen::MatrixXi F12(F1.rows()+F2r.rows(), F1.cols());
-    F12<<F1, (F2r.array()+V1.rows());
-
-    //V3r = ICP::FindBestStartRotation(V2r, V3r);
-    for (size_t i=0; i<iteration;i++) {
-        V3r = ICP::ICPOptimised(V12, V3r, 95);
+    // Every scan keeps its own index, it is only rebuilt when the scan changes
+    scans.resize(5);
+    scans[0].SetVertices(V1r);
+    scans[1].SetVertices(V2r);
+    scans[2].SetVertices(V3r);
+    scans[3].SetVertices(V4r);
+    scans[4].SetVertices(V5r);
+
+    // Pairwise ICP over the overlapping pairs, then globally consistent poses with V1 fixed
+    // A pair is kept if 30% of scan j lies on scan i once registered
+    const double min_overlap = 0.3;
+    std::vector<ICP::PoseGraphEdge> edges;
+    std::vector<std::pair<Eigen::Matrix3d, Eigen::RowVector3d>> poses = ICP::AlignMultiView(scans, convergence_criteria, subsample_rate, min_overlap, &edges);
+
+    for (size_t e = 0; e < edges.size(); e++){
+        std::cout << "  V" + std::to_string(edges[e].j + 1) + " -> V" + std::to_string(edges[e].i + 1) + ": " + std::to_string(edges[e].iterations) + " iteration(s), " + std::to_string(edges[e].overlap * 100) + "% overlap" << std::endl;
     }
 
-    Eigen::MatrixXd V123(V12.rows()+V3r.rows(), V1.cols());
-    V123<<V12, V3r;
-    Eigen::MatrixXi F123(F12.rows()+F3r.rows(), F1.cols());
-    F123<<F12, (F3r.array()+V12.rows());
-
-    //V4r = ICP::FindBestStartRotation(V3r, V4r);
-    for (size_t i=0; i<iteration;i++) {
-        V4r = ICP::ICPOptimised(V123, V4r, 95);
-    }
+    V2r = ICP::ApplyRigidTransform(V2r, poses[1]);
+    V3r = ICP::ApplyRigidTransform(V3r, poses[2]);
+    V4r = ICP::ApplyRigidTransform(V4r, poses[3]);
+    V5r = ICP::ApplyRigidTransform(V5r, poses[4]);
 
-    Eigen::MatrixXd V1234(V123.rows()+V4r.rows(), V1.cols());
-    V1234<<V123, V4r;
-    Eigen::MatrixXi F1234(F123.rows()+F4r.rows(), F1.cols());
-    F1234<<F123,(F4r.array()+V123.rows());
-
-    //V5r = ICP::FindBestStartRotation(V4r, V5r);
-    for (size_t i=0; i<iteration;i++) {
-        V5r = ICP::ICPOptimised(V1234, V5r, 95);
-    }
-
-    Eigen::MatrixXd V12345(V1234.rows()+V5.rows(), V1.cols());
-    V12345<<V1234, V5r;
-    Eigen::MatrixXi F12345(F1234.rows()+F5r.rows(), F1.cols());
-    F12345<<F1234,(F5r.array()+V1234.rows());
+    Eigen::MatrixXd V12345(V1r.rows()+V2r.rows()+V3r.rows()+V4r.rows()+V5r.rows(), V1r.cols());
+    V12345<<V1r, V2r, V3r, V4r, V5r;
+    Eigen::MatrixXi F12345(F1r.rows()+F2r.rows()+F3r.rows()+F4r.rows()+F5r.rows(), F1r.cols());
+    F12345<<F1r, (F2r.array()+V1r.rows()), (F3r.array()+V2r.rows()+V1r.rows()), (F4r.array()+V3r.rows()+V2r.rows()+V1r.rows()), (F5r.array()+V4r.rows()+V3r.rows()+V2r.rows()+V1r.rows());
 
     Eigen::MatrixXd C(F12345.rows(),3);
     C<<
@@ -397,8 +472,8 @@ void Scene::MultiMeshAlign(){
 
     rendering_data.push_back(RenderingData{V12345,F12345,C});
 
-    double time_taken = (clock() - start_time) / (double) CLOCKS_PER_SEC;
-    std::cout << "ICP Optimised takes " + std::to_string(time_taken) + "s to complete " + std::to_string(iteration) + " iteration(s)" << std::endl;
+    double time_taken = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    std::cout << "ICP Multi-View takes " + std::to_string(time_taken) + "s to align all scans over " + std::to_string(edges.size()) + " overlapping pair(s)" + GetFeatureSummary(num_matches) << std::endl;
 
     Visualise(rendering_data.size());
 }
@@ -408,18 +483,99 @@ void Scene::Point2PlaneAlign(){
 
     Eigen::MatrixXd Vx = V2;
 
-    clock_t start_time = std::clock();
+    ICP::Convergence convergence(convergence_criteria);
+
+    // Normals of V1 come from the target (from its faces unless turned off), they are only estimated again when V1 changes
+    target.SetVertices(V1, GetNormalFaces(F1));
+    const Eigen::MatrixXd& N = target.GetNormals();
+
+    // Normals of V2 are only needed by the normal test, they are turned with it
+    // V2 is only indexed if they are fitted to its neighbours
+    ICP::RejectionPolicy policy = GetRejectionPolicy(1.0, true);
+    bool normal_test = policy.max_normal_angle < 180.0;
+    Eigen::MatrixXd N2;
+    if (normal_test && face_normals){
+        N2 = ICP::GetVertexNormal(V2, F2);
+    }else if (normal_test){
+        source.SetVertices(V2);
+        N2 = source.GetNormals();
+    }
+    Eigen::MatrixXd Nx = N2;
+    ICP::CorrespondenceCache cache;
+
+    std::pair<Eigen::Matrix3d, Eigen::RowVector3d> transform(Eigen::Matrix3d::Identity(), Eigen::RowVector3d::Zero());
+    ICP::AndersonAcceleration anderson(anderson_window);
+
+    while (!convergence.Stopped()){
+        ICP::Correspondences correspondences = ICP::FindCorrespondences(target, Vx, policy, &cache, normal_test ? &Nx : nullptr);
+        ICP::PointToPlaneSums sums = ICP::GetPointToPlaneSums(V1, N, Vx, correspondences);
+        std::pair<Eigen::Matrix3d, Eigen::RowVector3d> step = ICP::EstimateRigidTransformNormalBased(sums);
+        transform = anderson.Update(sums.GetError(), transform, ICP::ComposeRigidTransform(transform, step));
+        ICP::ApplyRigidTransform(V2, transform, Vx);
+        if (normal_test){
+            Nx.noalias() = N2 * transform.first.transpose();
+        }
+
+        // Point-to-plane error before the step
+        convergence.Update(sums.GetError(), step);
+    }
+
+    std::cout << "ICP Advanced takes " + std::to_string(convergence.Seconds()) + "s to complete " + std::to_string(convergence.Iterations()) + " iteration(s)" + GetStopReason(convergence) << std::endl;
 
-    // Use the subsample to perform ICP algorithm
-    for (size_t i=0; i<iteration;i++){
-        Eigen::MatrixXd N = ICP::GetVertexNormal(V1);
-        std::pair<std::pair<Eigen::MatrixXd, Eigen::MatrixXd>, Eigen::MatrixXd> correspondences = ICP::FindCorrespondencesNormalBased(V1, Vx, N);
-        std::pair<Eigen::Matrix3d, Eigen::RowVector3d> transform = ICP::EstimateRigidTransformNormalBased(correspondences.first.first, correspondences.second, correspondences.first.second);
-        Vx = ICP::ApplyRigidTransform(Vx, transform);
+    // Generate data and store them for display
+    Eigen::MatrixXd V(V1.rows()+Vx.rows(), V1.cols());
+    V << V1,Vx;
+    Eigen::MatrixXi F(F1.rows()+F2.rows(),F1.cols());
+    F << F1,(F2.array()+V1.rows());
+    Eigen::MatrixXd C(F.rows(),3);
+    C <<
+      Eigen::RowVector3d(1.0,0.5,0.25).replicate(F1.rows(),1),
+      Eigen::RowVector3d(1.0,0.8,0.0).replicate(F2.rows(),1);
+
+    rendering_data.push_back(RenderingData{V,F,C});
+
+    Visualise(rendering_data.size());
+}
+
+void Scene::GeneralisedAlign(){
+    rendering_data.clear();
+
+    Eigen::MatrixXd Vx = V2;
+
+    ICP::Convergence convergence(convergence_criteria);
+
+    // Covariances of both scans are cached with their index, V2 is only indexed to get its own
+    // The faces only give the normals of the normal test, the covariances still come from the neighbours
+    target.SetVertices(V1, GetNormalFaces(F1));
+    source.SetVertices(V2);
+    const std::vector<Eigen::Matrix3d>& C2 = source.GetCovariances();
+
+    // Normals of V2 are only needed by the normal test, they are turned with it
+    ICP::RejectionPolicy policy = GetRejectionPolicy(2.0, true);
+    bool normal_test = policy.max_normal_angle < 180.0;
+    Eigen::MatrixXd N2;
+    if (normal_test){
+        N2 = face_normals ? ICP::GetVertexNormal(V2, F2) : source.GetNormals();
+    }
+    Eigen::MatrixXd Nx = N2;
+    ICP::CorrespondenceCache cache;
+
+    // Transform applied to V2 so far, the source covariances follow its rotation
+    std::pair<Eigen::Matrix3d, Eigen::RowVector3d> transform(Eigen::Matrix3d::Identity(), Eigen::RowVector3d::Zero());
+
+    while (!convergence.Stopped()){
+        ICP::Correspondences correspondences = ICP::FindCorrespondences(target, Vx, policy, &cache, normal_test ? &Nx : nullptr);
+        std::pair<double, std::pair<Eigen::Matrix3d, Eigen::RowVector3d>> transform_info = ICP::EstimateRigidTransformGeneralised(target, Vx, C2, transform.first, correspondences);
+        transform = ICP::ComposeRigidTransform(transform, transform_info.second);
+        ICP::ApplyRigidTransform(V2, transform, Vx);
+        if (normal_test){
+            Nx.noalias() = N2 * transform.first.transpose();
+        }
+
+        convergence.Update(transform_info.first, transform_info.second);
     }
 
-    double time_taken = (clock() - start_time) / (double) CLOCKS_PER_SEC;
-    std::cout << "ICP Advanced takes " + std::to_string(time_taken) + "s to complete " + std::to_string(iteration) + " iteration(s)" << std::endl;
+    std::cout << "ICP Generalised takes " + std::to_string(convergence.Seconds()) + "s to complete " + std::to_string(convergence.Iterations()) + " iteration(s)" + GetStopReason(convergence) << std::endl;
 
     // Generate data and store them for display
     Eigen::MatrixXd V(V1.rows()+Vx.rows(), V1.cols());
@@ -442,12 +598,103 @@ void Scene::SetIteration(int i){
     }else{
         iteration = i;
     }
+    convergence_criteria.max_iteration = iteration;
+}
+
+void Scene::SetTolerance(double t){
+    convergence_criteria.relative_rms_change = t < 0 ? 0 : t;
+}
+
+void Scene::SetTimeBudget(double s){
+    convergence_criteria.time_budget = s < 0 ? 0 : s;
+}
+
+void Scene::SetAndersonWindow(int m){
+    anderson_window = m < 0 ? 0 : m;
+}
+
+void Scene::SetStartPose(int p){
+    start_pose = p == 1 ? START_ROTATION : p == 2 ? START_FEATURES : START_NONE;
+}
+
+Eigen::MatrixXd Scene::MoveToStartPose(const ICP::Target& target, const Eigen::MatrixXd& V, size_t* num_matches) const{
+
+    if (start_pose == START_ROTATION){
+        return ICP::FindBestStartRotation(target, V);
+    }
+
+    if (start_pose == START_FEATURES){
+        return MoveToFeaturePose(target.GetVertices(), V, num_matches);
+    }
+
+    return V;
+}
+
+Eigen::MatrixXd Scene::MoveToFeaturePose(const Eigen::MatrixXd& V_target, const Eigen::MatrixXd& V, size_t* num_matches) const{
+
+    // Keypoints about 50 voxels across the target, roughly 1.5k per bun scan
+    double voxel_size = (V_target.colwise().maxCoeff() - V_target.colwise().minCoeff()).norm() / 50;
+
+    std::pair<Eigen::Matrix3d, Eigen::RowVector3d> pose = ICP::FindFeaturePose(ICP::GetFeatures(V_target, voxel_size), ICP::GetFeatures(V, voxel_size), voxel_size, 100000, num_matches);
+    return ICP::ApplyRigidTransform(V, pose);
+}
+
+void Scene::SetRobustKernel(int k){
+    switch (k){
+        case 1: robust_kernel = ICP::RobustKernel::Huber(); break;
+        case 2: robust_kernel = ICP::RobustKernel::Tukey(); break;
+        case 3: robust_kernel = ICP::RobustKernel::Cauchy(); break;
+        default: robust_kernel = ICP::RobustKernel(); break;
+    }
+}
+
+void Scene::SetRejection(int r){
+    switch (r){
+        case 1: rejection = ICP::RejectionPolicy::REJECT_MAD; break;
+        case 2: rejection = ICP::RejectionPolicy::REJECT_PERCENTILE; break;
+        default: rejection = ICP::RejectionPolicy::REJECT_MEDIAN; break;
+    }
+}
+
+void Scene::SetMaxNormalAngle(double a){
+    max_normal_angle = a <= 0 || a > 180 ? 180.0 : a;
+}
+
+ICP::RejectionPolicy Scene::GetRejectionPolicy(double k, bool with_normals) const{
+
+    ICP::RejectionPolicy policy;
+
+    // The kernel takes over from the distance cut, far pairs fade out instead of being dropped
+    if (robust_kernel.type != ICP::RobustKernel::KERNEL_NONE){
+        policy = ICP::RejectionPolicy::Robust(robust_kernel);
+    }else if (rejection == ICP::RejectionPolicy::REJECT_MAD){
+        policy = ICP::RejectionPolicy::MAD(3.0);
+    }else if (rejection == ICP::RejectionPolicy::REJECT_PERCENTILE){
+        policy = ICP::RejectionPolicy::Percentile(0.9);
+    }else{
+        policy = ICP::RejectionPolicy::Median(k);
+    }
+
+    if (with_normals){
+        policy.max_normal_angle = max_normal_angle;
+    }
+
+    return policy;
 }
 
 void Scene::SetMarkOut(bool b) {
     mark_out = b;
 }
 
+void Scene::SetFaceNormals(bool b){
+    face_normals = b;
+}
+
+const Eigen::MatrixXi& Scene::GetNormalFaces(const Eigen::MatrixXi& F) const{
+    static const Eigen::MatrixXi no_faces(0, 3);
+    return face_normals ? F : no_faces;
+}
+
 void Scene::Visualise(int i){
     if (i > 0 && i <= rendering_data.size()){
         viewer.data().clear();
@@ -16,6 +16,7 @@ public:
     
     // Task 4
     void Point2PointAlignOptimised();
+    void Point2PointAlignPyramid();
     
     // Task 5
     void LoadMultiple();
@@ -23,12 +24,21 @@ public:
     
     // Task 6
     void Point2PlaneAlign();
+    void GeneralisedAlign();
     
     // Utility
     void Initialise();
     void Visualise(int i);
     void SetIteration(int i);
+    void SetTolerance(double t);
+    void SetTimeBudget(double s);
+    void SetRobustKernel(int k);
+    void SetRejection(int r);
+    void SetMaxNormalAngle(double a);
+    void SetAndersonWindow(int m);
+    void SetStartPose(int p);
     void SetMarkOut(bool b);
+    void SetFaceNormals(bool b);
     void SetSubsampleRate(double s);
     
 private:
@@ -37,11 +47,62 @@ private:
     
     Eigen::MatrixXd V1, V2, V3, V4, V5;
     Eigen::MatrixXi F1, F2, F3, F4, F5;
+
+    // Indexed V1
+    ICP::Target target;
+
+    // Indexed V2, only used for the per-vertex covariances of Generalized-ICP
+    ICP::Target source;
+
+    // Voxel-subsampled levels of V1 for coarse-to-fine alignment
+    ICP::TargetPyramid target_pyramid;
+
+    // Indexed V1..V5 of the multi-view alignment, one per scan
+    std::vector<ICP::Target> scans;
     
+    // Pair rejection of the drivers: k * median distance, MAD or percentile, or the robust kernel if one is selected
+    // The normal angle test is only added for drivers that have normals for both scans
+    ICP::RejectionPolicy GetRejectionPolicy(double k, bool with_normals = false) const;
+
     int iteration;
+
+    // When the ICP loops stop, iteration is the upper limit
+    ICP::ConvergenceCriteria convergence_criteria;
+
+    // IRLS weighting of the pairs, none by default
+    ICP::RobustKernel robust_kernel;
+
+    // Distance test of the pairs, k * median by default
+    ICP::RejectionPolicy::Type rejection;
+
+    // Largest angle between paired normals in the normal-based and generalised drivers, 180 turns the test off
+    double max_normal_angle;
+
+    // History length of the Anderson acceleration, 0 runs plain ICP
+    int anderson_window;
+
+    // Global start pose searched before the point-to-point drivers, by rotation racing (ICP::FindStartPose)
+    // or by matching FPFH features (ICP::FindFeaturePose)
+    enum StartPose{
+        START_NONE,
+        START_ROTATION,
+        START_FEATURES
+    };
+    StartPose start_pose;
+
+    // V moved to the selected start pose against the indexed target
+    // num_matches (if given) receives the feature matches the pose was found from
+    Eigen::MatrixXd MoveToStartPose(const ICP::Target& target, const Eigen::MatrixXd& V, size_t* num_matches = nullptr) const;
+
+    // V moved to the pose of the best feature matches against V_target, which is not queried through an index
+    Eigen::MatrixXd MoveToFeaturePose(const Eigen::MatrixXd& V_target, const Eigen::MatrixXd& V, size_t* num_matches = nullptr) const;
     double subsample_rate;
     bool mark_out;
 
+    // Normals of the normal-based drivers from the mesh faces, or fitted to the neighbours if off
+    bool face_normals;
+    const Eigen::MatrixXi& GetNormalFaces(const Eigen::MatrixXi& F) const;
+
     struct RenderingData;
 
     // Can record the entire ICP matching process
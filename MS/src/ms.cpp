@@ -15,7 +15,7 @@
 #include "Spectra/MatOp/SparseSymMatProd.h"
 #include "ms.h"
 
-Eigen::SparseMatrix<double> MS::LaplacianMatrix(Eigen::MatrixXd V_in, Eigen::MatrixXi F_in) {
+Eigen::SparseMatrix<double> MS::LaplacianMatrix(const Eigen::Ref<const Eigen::MatrixXd>& V_in, const Eigen::Ref<const Eigen::MatrixXi>& F_in) {
 
     Eigen::SparseMatrix<double> laplacian_matrix(V_in.rows(), V_in.rows());
 
@@ -38,7 +38,7 @@ Eigen::SparseMatrix<double> MS::LaplacianMatrix(Eigen::MatrixXd V_in, Eigen::Mat
     return laplacian_matrix;
 }
 
-Eigen::SparseMatrix<double> MS::CotangentMatrix(Eigen::MatrixXd V_in, Eigen::MatrixXi F_in){
+Eigen::SparseMatrix<double> MS::CotangentMatrix(const Eigen::Ref<const Eigen::MatrixXd>& V_in, const Eigen::Ref<const Eigen::MatrixXi>& F_in){
 
     Eigen::SparseMatrix<double> contangent_matrix(V_in.rows(), V_in.rows());
 
@@ -119,7 +119,7 @@ Eigen::SparseMatrix<double> MS::CotangentMatrix(Eigen::MatrixXd V_in, Eigen::Mat
 
 }
 
-Eigen::SparseMatrix<double> MS::BarycentricMassMatrix(Eigen::MatrixXd V_in, Eigen::MatrixXi F_in){
+Eigen::SparseMatrix<double> MS::BarycentricMassMatrix(const Eigen::Ref<const Eigen::MatrixXd>& V_in, const Eigen::Ref<const Eigen::MatrixXi>& F_in){
 
     Eigen::SparseMatrix<double> mass_matrix(V_in.rows(), V_in.rows());
 	std::vector<double> area_value_list;
@@ -153,7 +153,7 @@ Eigen::SparseMatrix<double> MS::BarycentricMassMatrix(Eigen::MatrixXd V_in, Eige
     return mass_matrix;
 }
 
-Eigen::SparseMatrix<double> MS::LaplaceBeltramiMatrix(Eigen::MatrixXd V_in, Eigen::MatrixXi F_in){
+Eigen::SparseMatrix<double> MS::LaplaceBeltramiMatrix(const Eigen::Ref<const Eigen::MatrixXd>& V_in, const Eigen::Ref<const Eigen::MatrixXi>& F_in){
 
 	Eigen::SparseMatrix<double> L_sparse(V_in.rows(), V_in.rows());
 
@@ -169,7 +169,7 @@ Eigen::SparseMatrix<double> MS::LaplaceBeltramiMatrix(Eigen::MatrixXd V_in, Eige
     return L_sparse;
 }
 
-Eigen::VectorXd MS::UniformMeanCurvature(Eigen::MatrixXd V_in, Eigen::MatrixXi F_in){
+Eigen::VectorXd MS::UniformMeanCurvature(const Eigen::Ref<const Eigen::MatrixXd>& V_in, const Eigen::Ref<const Eigen::MatrixXi>& F_in){
 
     Eigen::VectorXd H(V_in.rows());
     H.setZero();
@@ -183,7 +183,7 @@ Eigen::VectorXd MS::UniformMeanCurvature(Eigen::MatrixXd V_in, Eigen::MatrixXi F
     return H;
 }
 
-Eigen::VectorXd MS::GaussianCurvature(Eigen::MatrixXd V_in, Eigen::MatrixXi F_in){
+Eigen::VectorXd MS::GaussianCurvature(const Eigen::Ref<const Eigen::MatrixXd>& V_in, const Eigen::Ref<const Eigen::MatrixXi>& F_in){
 
     Eigen::VectorXd K(V_in.rows());
     Eigen::SparseMatrix<double> area = BarycentricMassMatrix(V_in, F_in);
@@ -226,7 +226,7 @@ Eigen::VectorXd MS::GaussianCurvature(Eigen::MatrixXd V_in, Eigen::MatrixXi F_in
     return K;
 }
 
-Eigen::VectorXd MS::NonUniformMeanCurvature(Eigen::MatrixXd V_in, Eigen::MatrixXi F_in){
+Eigen::VectorXd MS::NonUniformMeanCurvature(const Eigen::Ref<const Eigen::MatrixXd>& V_in, const Eigen::Ref<const Eigen::MatrixXi>& F_in){
 
     Eigen::VectorXd H(V_in.rows());
     H.setZero();
@@ -241,7 +241,7 @@ Eigen::VectorXd MS::NonUniformMeanCurvature(Eigen::MatrixXd V_in, Eigen::MatrixX
     return H;
 }
 
-Eigen::MatrixXd MS::Reconstruction(Eigen::MatrixXd V_in, Eigen::MatrixXi F_in, int k){
+Eigen::MatrixXd MS::Reconstruction(const Eigen::Ref<const Eigen::MatrixXd>& V_in, const Eigen::Ref<const Eigen::MatrixXi>& F_in, int k){
 
 	Eigen::MatrixXd V_recon(V_in.rows(), V_in.cols());
 	V_recon.setZero();
@@ -287,22 +287,27 @@ Eigen::MatrixXd MS::Reconstruction(Eigen::MatrixXd V_in, Eigen::MatrixXi F_in, i
     return V_recon;
 }
 
-Eigen::MatrixXd MS::ExplicitSmoothing(Eigen::MatrixXd V_in, Eigen::MatrixXi F_in, double lambda, int iteration){
+Eigen::MatrixXd MS::ExplicitSmoothing(const Eigen::Ref<const Eigen::MatrixXd>& V_in, const Eigen::Ref<const Eigen::MatrixXi>& F_in, double lambda, int iteration){
 
     Eigen::SparseMatrix<double> L = MS::LaplaceBeltramiMatrix(V_in, F_in);
     Eigen::SparseMatrix<double> I(V_in.rows(),V_in.rows());
     I.setIdentity();
+
+    // Build I + lambda*L once, the two buffers are swapped instead of allocating a new matrix per step
+    Eigen::SparseMatrix<double> A = I + lambda*L;
     Eigen::MatrixXd V_out = V_in;
+    Eigen::MatrixXd V_next(V_out.rows(), V_out.cols());
 
 	// Compute using explicit scheme
     for (int i =0; i < iteration; i++){
-        V_out = (I+lambda*L)*V_out;
+        V_next.noalias() = A*V_out;
+        V_out.swap(V_next);
     }
 
     return V_out;
 }
 
-Eigen::MatrixXd MS::ImplicitSmoothing(Eigen::MatrixXd V_in, Eigen::MatrixXi F_in, double lambda, int iteration){
+Eigen::MatrixXd MS::ImplicitSmoothing(const Eigen::Ref<const Eigen::MatrixXd>& V_in, const Eigen::Ref<const Eigen::MatrixXi>& F_in, double lambda, int iteration){
 
     Eigen::MatrixXd V_out = V_in;
 
@@ -320,7 +325,7 @@ Eigen::MatrixXd MS::ImplicitSmoothing(Eigen::MatrixXd V_in, Eigen::MatrixXi F_in
     return V_out;
 }
 
-Eigen::MatrixXd MS::AddNoise(Eigen::MatrixXd V_in, double sd){
+Eigen::MatrixXd MS::AddNoise(const Eigen::Ref<const Eigen::MatrixXd>& V_in, double sd){
     
     // Initialise output matrix
     Eigen::MatrixXd V_out;
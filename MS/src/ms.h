@@ -1,18 +1,21 @@
 namespace MS{
 
-    Eigen::SparseMatrix<double> LaplacianMatrix(Eigen::MatrixXd V_in, Eigen::MatrixXi F_in);
-    Eigen::SparseMatrix<double> CotangentMatrix(Eigen::MatrixXd V_in, Eigen::MatrixXi F_in);
-    Eigen::SparseMatrix<double> BarycentricMassMatrix(Eigen::MatrixXd V_in, Eigen::MatrixXi F_in);
-    Eigen::SparseMatrix<double> LaplaceBeltramiMatrix(Eigen::MatrixXd V_in, Eigen::MatrixXi F_in);
+    // Scans are taken by const Eigen::Ref, which binds a MatrixXd, a block or any expression (evaluated once),
+    // so no by-value overloads are kept: they would win over the Ref for a plain MatrixXd and copy it again
 
-    Eigen::VectorXd UniformMeanCurvature(Eigen::MatrixXd V_in, Eigen::MatrixXi F_in);
-    Eigen::VectorXd GaussianCurvature(Eigen::MatrixXd V_in, Eigen::MatrixXi F_in);
-    Eigen::VectorXd NonUniformMeanCurvature(Eigen::MatrixXd V_in, Eigen::MatrixXi F_in);
-    Eigen::MatrixXd Reconstruction(Eigen::MatrixXd V_in, Eigen::MatrixXi F_in, int k);
+    Eigen::SparseMatrix<double> LaplacianMatrix(const Eigen::Ref<const Eigen::MatrixXd>& V_in, const Eigen::Ref<const Eigen::MatrixXi>& F_in);
+    Eigen::SparseMatrix<double> CotangentMatrix(const Eigen::Ref<const Eigen::MatrixXd>& V_in, const Eigen::Ref<const Eigen::MatrixXi>& F_in);
+    Eigen::SparseMatrix<double> BarycentricMassMatrix(const Eigen::Ref<const Eigen::MatrixXd>& V_in, const Eigen::Ref<const Eigen::MatrixXi>& F_in);
+    Eigen::SparseMatrix<double> LaplaceBeltramiMatrix(const Eigen::Ref<const Eigen::MatrixXd>& V_in, const Eigen::Ref<const Eigen::MatrixXi>& F_in);
 
-    Eigen::MatrixXd ExplicitSmoothing(Eigen::MatrixXd V_in, Eigen::MatrixXi F_in, double lambda, int iteration);
-    Eigen::MatrixXd ImplicitSmoothing(Eigen::MatrixXd V_in, Eigen::MatrixXi F_in, double lambda, int iteration);
-    Eigen::MatrixXd AddNoise(Eigen::MatrixXd V_in, double noise);
+    Eigen::VectorXd UniformMeanCurvature(const Eigen::Ref<const Eigen::MatrixXd>& V_in, const Eigen::Ref<const Eigen::MatrixXi>& F_in);
+    Eigen::VectorXd GaussianCurvature(const Eigen::Ref<const Eigen::MatrixXd>& V_in, const Eigen::Ref<const Eigen::MatrixXi>& F_in);
+    Eigen::VectorXd NonUniformMeanCurvature(const Eigen::Ref<const Eigen::MatrixXd>& V_in, const Eigen::Ref<const Eigen::MatrixXi>& F_in);
+    Eigen::MatrixXd Reconstruction(const Eigen::Ref<const Eigen::MatrixXd>& V_in, const Eigen::Ref<const Eigen::MatrixXi>& F_in, int k);
+
+    Eigen::MatrixXd ExplicitSmoothing(const Eigen::Ref<const Eigen::MatrixXd>& V_in, const Eigen::Ref<const Eigen::MatrixXi>& F_in, double lambda, int iteration);
+    Eigen::MatrixXd ImplicitSmoothing(const Eigen::Ref<const Eigen::MatrixXd>& V_in, const Eigen::Ref<const Eigen::MatrixXi>& F_in, double lambda, int iteration);
+    Eigen::MatrixXd AddNoise(const Eigen::Ref<const Eigen::MatrixXd>& V_in, double noise);
 
 }
 